@@ -2,6 +2,7 @@
 #include "headers/utils_header.h"
 #include<iostream>
 #include <sys/stat.h>
+#include <csignal>
 using namespace std;
 
 
@@ -22,6 +23,10 @@ int main(int argc, char *argv[]) {
     int my_port = stoi(address.substr(colon_pos + 1));
     string tracker_file = argv[2];
 
+    // a leecher that resets its connection mid-piece must not kill the seeder: send() passes
+    // MSG_NOSIGNAL, but sendfile64 has no such flag and would raise SIGPIPE
+    signal(SIGPIPE, SIG_IGN);
+
     Client client(my_ip, my_port, tracker_file);
 
 
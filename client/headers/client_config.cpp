@@ -0,0 +1,42 @@
+#include "./config_header.h"
+#include "./file_header.h"
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include <algorithm>
+using namespace std;
+
+// "0", "off", "false" and "no" switch a flag off, anything else switches it on
+static bool env_flag(const char* name, bool fallback) {
+    const char* value = getenv(name);
+    if (value == nullptr || *value == '\0') return fallback;
+    if (strcmp(value, "0") == 0 || strcasecmp(value, "off") == 0 ||
+        strcasecmp(value, "false") == 0 || strcasecmp(value, "no") == 0) {
+        return false;
+    }
+    return true;
+}
+
+static long env_number(const char* name, long fallback, long min_value, long max_value) {
+    const char* value = getenv(name);
+    if (value == nullptr || *value == '\0') return fallback;
+    char* end = nullptr;
+    long number = strtol(value, &end, 10);
+    if (end == value || *end != '\0') return fallback;
+    return max(min_value, min(max_value, number));
+}
+
+static ClientConfig load_client_config() {
+    ClientConfig config;
+    config.zero_copy = env_flag("P2P_ZERO_COPY", true);
+    config.pipeline_depth = (int)env_number("P2P_PIPELINE_DEPTH", 0, 0, 1024);
+    config.io_uring = env_flag("P2P_IO_URING", false);
+    config.mmap_writes = env_flag("P2P_MMAP_WRITES", false);
+    config.piece_size = env_number("P2P_PIECE_SIZE", 0, 0, (long)MAX_PIECE_SIZE);
+    return config;
+}
+
+const ClientConfig& client_config() {
+    static const ClientConfig config = load_client_config();
+    return config;
+}
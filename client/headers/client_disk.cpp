@@ -0,0 +1,443 @@
+#include "./disk_header.h"
+#include "./config_header.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <climits>
+#include <cerrno>
+
+using namespace std;
+
+static bool pwrite_all(int fd, const char* data, size_t len, uint64_t offset) {
+    size_t written = 0;
+    while (written < len) {
+        ssize_t w = pwrite64(fd, data + written, len - written, (off64_t)(offset + written));
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) {
+            perror("pwrite64");
+            return false;
+        }
+        written += (size_t)w;
+    }
+    return true;
+}
+
+//-------------------------------------------------------Piece Buffers----------------------------------------------------------//
+
+PieceBuffer::~PieceBuffer() {
+    if (bytes) piece_buffers().release(bytes, capacity);
+}
+
+PieceBuffer::PieceBuffer(PieceBuffer&& other) noexcept
+    : bytes(exchange(other.bytes, nullptr)), capacity(other.capacity), length(other.length) {}
+
+PieceBuffer& PieceBuffer::operator=(PieceBuffer&& other) noexcept {
+    if (this != &other) {
+        if (bytes) piece_buffers().release(bytes, capacity);
+        bytes = exchange(other.bytes, nullptr);
+        capacity = other.capacity;
+        length = other.length;
+    }
+    return *this;
+}
+
+PieceBuffer PieceBufferPool::acquire(size_t size) {
+    size_t capacity = max<size_t>(1, (size + PIECE_BUFFER_ALIGN - 1) / PIECE_BUFFER_ALIGN) * PIECE_BUFFER_ALIGN;
+    {
+        lock_guard<mutex> lock(m);
+        auto it = idle.find(capacity);
+        if (it != idle.end() && !it->second.empty()) {
+            char* bytes = it->second.back();
+            it->second.pop_back();
+            idle_bytes -= capacity;
+            return PieceBuffer(bytes, capacity, size);
+        }
+    }
+    // no zero fill: every byte is overwritten by the receive before anyone reads it
+    void* bytes = aligned_alloc(PIECE_BUFFER_ALIGN, capacity);
+    if (bytes == nullptr) throw bad_alloc();
+    return PieceBuffer((char*)bytes, capacity, size);
+}
+
+void PieceBufferPool::release(char* bytes, size_t capacity) {
+    {
+        lock_guard<mutex> lock(m);
+        if (idle_bytes + capacity <= PIECE_BUFFER_POOL_BYTES) {
+            idle[capacity].push_back(bytes);
+            idle_bytes += capacity;
+            return;
+        }
+    }
+    free(bytes);
+}
+
+// never destroyed: buffers still queued on the writer's completion thread return to it at exit
+PieceBufferPool& piece_buffers() {
+    static PieceBufferPool* instance = new PieceBufferPool();
+    return *instance;
+}
+
+//-------------------------------------------------------Piece Writer----------------------------------------------------------//
+
+PieceWriter::PieceWriter() {
+    if (!client_config().io_uring) return;
+    if (!ring.init(PIECE_WRITER_DEPTH)) {
+        cerr << "io_uring not available, piece writes fall back to pwrite\n";
+        return;
+    }
+    if (ring.register_file_table(PIECE_WRITER_FILE_SLOTS)) {
+        slot_used.assign(PIECE_WRITER_FILE_SLOTS, false);
+    }
+    // lives as long as the process, like the writer itself
+    completion_thread = thread(&PieceWriter::completion_loop, this);
+    completion_thread.detach();
+}
+
+int PieceWriter::register_file(int fd) {
+    lock_guard<mutex> lock(m);
+    for (size_t slot = 0; slot < slot_used.size(); ++slot) {
+        if (!slot_used[slot] && ring.update_file(slot, fd)) {
+            slot_used[slot] = true;
+            return (int)slot;
+        }
+    }
+    return -1;
+}
+
+void PieceWriter::unregister_file(int slot) {
+    if (slot < 0) return;
+    lock_guard<mutex> lock(m);
+    ring.update_file(slot, -1);
+    slot_used[slot] = false;
+}
+
+void PieceWriter::write(int fd, int slot, uint64_t offset, PieceBuffer data, Done done) {
+    if (!async()) {
+        done(pwrite_all(fd, data.data(), data.size(), offset));
+        return;
+    }
+
+    unique_lock<mutex> lock(m);
+    space_cv.wait(lock, [this] { return in_flight.size() < ring.depth(); });
+
+    uint64_t id = next_id++;
+    auto request = make_unique<Request>(Request{fd, slot, offset, move(data), 0, move(done)});
+    Request& queued = *request;
+    in_flight[id] = move(request);
+    if (!queue_locked(id, queued)) {
+        // can not happen while in_flight is bounded by the ring depth, but never lose the callback
+        Done failed = move(queued.done);
+        in_flight.erase(id);
+        lock.unlock();
+        failed(false);
+        return;
+    }
+    submit_queued(lock);
+}
+
+bool PieceWriter::queue_locked(uint64_t id, Request& request) {
+    size_t left = request.data.size() - request.written;
+    unsigned len = (unsigned)min<size_t>(left, UINT_MAX);
+    bool fixed = request.slot >= 0;
+    if (!ring.prep_write(fixed ? request.slot : request.fd, fixed, request.data.data() + request.written,
+                         len, request.offset + request.written, -1, id)) {
+        return false;
+    }
+    unsubmitted++;
+    return true;
+}
+
+// the first thread to get here submits for everyone: writes queued while it sits in io_uring_enter
+// go out with its next round, so concurrent seeder loops share one syscall
+void PieceWriter::submit_queued(unique_lock<mutex>& lock) {
+    if (submitting) return;
+    submitting = true;
+    while (unsubmitted > 0) {
+        unsigned to_submit = ring.publish();
+        unsubmitted = 0;
+        lock.unlock();
+        int ret = ring.enter(to_submit, 0);
+        lock.lock();
+        if (ret < 0) {
+            errno = -ret;
+            perror("io_uring_enter");
+        }
+    }
+    submitting = false;
+}
+
+void PieceWriter::completion_loop() {
+    while (true) {
+        int ret = ring.wait();
+        if (ret < 0 && ret != -EAGAIN && ret != -EBUSY) {
+            errno = -ret;
+            perror("io_uring wait");
+            this_thread::sleep_for(chrono::milliseconds(10));
+        }
+
+        UringCompletion completion;
+        while (ring.next_completion(completion)) {
+            unique_lock<mutex> lock(m);
+            auto it = in_flight.find(completion.user_data);
+            if (it == in_flight.end()) continue;
+            Request& request = *it->second;
+
+            // short write: queue the rest of the piece again
+            if (completion.res > 0 && request.written + completion.res < request.data.size()) {
+                request.written += completion.res;
+                if (queue_locked(it->first, request)) {
+                    submit_queued(lock);
+                    continue;
+                }
+            }
+
+            bool written = completion.res > 0 && request.written + completion.res == request.data.size();
+            if (completion.res < 0) {
+                errno = -completion.res;
+                perror("io_uring write");
+            }
+            unique_ptr<Request> finished = move(it->second);
+            in_flight.erase(it);
+            lock.unlock();
+            space_cv.notify_one();
+            finished->done(written);
+        }
+    }
+}
+
+// never destroyed: the completion thread keeps using it until the process exits
+PieceWriter& piece_writer() {
+    static PieceWriter* instance = new PieceWriter();
+    return *instance;
+}
+
+//-------------------------------------------------------FD Cache----------------------------------------------------------//
+
+OpenFile::OpenFile(int fd, const struct stat64& st)
+    : fd(fd), size(st.st_size), dev(st.st_dev), ino(st.st_ino), mtime(st.st_mtim) {}
+
+OpenFile::~OpenFile() {
+    close(fd);
+}
+
+static bool same_file(const OpenFile& file, const struct stat64& st) {
+    return file.dev == st.st_dev && file.ino == st.st_ino && file.size == (uint64_t)st.st_size &&
+           file.mtime.tv_sec == st.st_mtim.tv_sec && file.mtime.tv_nsec == st.st_mtim.tv_nsec;
+}
+
+shared_ptr<OpenFile> FdCache::acquire(const string& path, bool writable) {
+    string key = (writable ? "w:" : "r:") + path;
+    shared_ptr<OpenFile> cached;
+    {
+        lock_guard<mutex> lock(m);
+        auto it = entries.find(key);
+        if (it != entries.end()) {
+            lru.splice(lru.begin(), lru, it->second.lru_pos);
+            if (chrono::steady_clock::now() - it->second.checked_at < chrono::milliseconds(FD_CACHE_REVALIDATE_MS)) {
+                return it->second.file;
+            }
+            cached = it->second.file;
+        }
+    }
+
+    // the system calls run without the lock, other paths keep being served meanwhile
+    struct stat64 st{};
+    if (stat64(path.c_str(), &st) == -1) {
+        perror("stat64");
+        invalidate(path);
+        return nullptr;
+    }
+
+    shared_ptr<OpenFile> file;
+    if (cached && same_file(*cached, st)) {
+        file = cached;
+    } else {
+        int fd = open64(path.c_str(), (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+        if (fd < 0) {
+            perror("open64");
+            return nullptr;
+        }
+        // describe what was actually opened, the path may have been replaced since the stat64
+        if (fstat64(fd, &st) == -1) {
+            perror("fstat64");
+            close(fd);
+            return nullptr;
+        }
+        file = make_shared<OpenFile>(fd, st);
+    }
+
+    lock_guard<mutex> lock(m);
+    auto it = entries.find(key);
+    if (it == entries.end()) {
+        lru.push_front(key);
+        it = entries.emplace(key, Entry{path, nullptr, {}, lru.begin()}).first;
+    }
+    it->second.file = file;
+    it->second.checked_at = chrono::steady_clock::now();
+    while (entries.size() > FD_CACHE_CAPACITY) {
+        erase_locked(entries.find(lru.back()));
+    }
+    return file;
+}
+
+void FdCache::erase_locked(unordered_map<string, Entry>::iterator it) {
+    lru.erase(it->second.lru_pos);
+    entries.erase(it);
+}
+
+void FdCache::invalidate(const string& path) {
+    lock_guard<mutex> lock(m);
+    for (const char* mode : {"r:", "w:"}) {
+        auto it = entries.find(mode + path);
+        if (it != entries.end()) erase_locked(it);
+    }
+}
+
+void FdCache::invalidate_name(const string& file_name) {
+    lock_guard<mutex> lock(m);
+    for (auto it = entries.begin(); it != entries.end();) {
+        const string& path = it->second.path;
+        auto next = std::next(it);
+        if (path.substr(path.find_last_of('/') + 1) == file_name) erase_locked(it);
+        it = next;
+    }
+}
+
+// never destroyed, like the piece writer: detached loops may still hold descriptors at exit
+FdCache& fd_cache() {
+    static FdCache* instance = new FdCache();
+    return *instance;
+}
+
+//-------------------------------------------------------Mapped File----------------------------------------------------------//
+
+MappedFile::~MappedFile() {
+    if (base) munmap(base, length);
+}
+
+bool MappedFile::map(int fd, uint64_t size) {
+    if (size == 0) return false;
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+    // pieces arrive in rarest-first order, read-ahead around them would be wasted
+    madvise(p, size, MADV_RANDOM);
+    base = (char*)p;
+    length = size;
+    this->fd = fd;
+    return true;
+}
+
+void MappedFile::flush(uint64_t offset, uint64_t len) {
+    if (sync_file_range(fd, offset, len, SYNC_FILE_RANGE_WRITE) != 0) perror("sync_file_range");
+}
+
+//-------------------------------------------------------Piece Journal----------------------------------------------------------//
+
+PieceJournal::~PieceJournal() {
+    if (mapping) munmap(mapping, mapping_size);
+}
+
+bool PieceJournal::open(const string& destination, const Digest& full_SHA, uint64_t size, uint64_t piece_size, size_t pieces) {
+    this->pieces = pieces;
+    path = destination + PIECE_JOURNAL_SUFFIX;
+
+    WireWriter header;
+    header.bytes(PIECE_JOURNAL_MAGIC, sizeof(PIECE_JOURNAL_MAGIC));
+    header.u8(PIECE_JOURNAL_VERSION);
+    header.bytes(full_SHA.data(), DIGEST_SIZE);
+    header.u64(size);
+    header.u64(piece_size);
+    header.u32((uint32_t)pieces);
+
+    persistent = map_file(header.out);
+    if (!persistent && !map_anonymous()) return false;
+    bits = mapping + PIECE_JOURNAL_HEADER_SIZE;
+    return true;
+}
+
+bool PieceJournal::map_file(const string& header) {
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror(("open " + path).c_str());
+        return false;
+    }
+
+    // an existing journal of the same file keeps its bits, anything else is started over
+    size_t length = header.size() + bitfield_size(pieces);
+    string existing(header.size(), '\0');
+    struct stat64 st{};
+    bool same_file = fstat64(fd, &st) == 0 && (uint64_t)st.st_size == length &&
+                     pread64(fd, &existing[0], existing.size(), 0) == (ssize_t)existing.size() && existing == header;
+    if (!same_file) {
+        if (ftruncate(fd, 0) != 0 || ftruncate(fd, length) != 0 || !pwrite_all(fd, header.data(), header.size(), 0)) {
+            perror(("reset " + path).c_str());
+            close(fd);
+            return false;
+        }
+    }
+
+    void* p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        perror(("mmap " + path).c_str());
+        return false;
+    }
+    mapping = (uint8_t*)p;
+    mapping_size = length;
+    return true;
+}
+
+// same layout without a file behind it, so the download loops do not care which one they got
+bool PieceJournal::map_anonymous() {
+    size_t length = PIECE_JOURNAL_HEADER_SIZE + bitfield_size(pieces);
+    void* p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap journal");
+        return false;
+    }
+    mapping = (uint8_t*)p;
+    mapping_size = length;
+    return true;
+}
+
+bool PieceJournal::has(size_t piece) const {
+    return __atomic_load_n(&bits[piece / 8], __ATOMIC_ACQUIRE) & (0x80 >> (piece % 8));
+}
+
+// pieces sharing a byte are set by different loops at once, so every update is an atomic or/and
+void PieceJournal::mark(size_t piece) {
+    __atomic_fetch_or(&bits[piece / 8], (uint8_t)(0x80 >> (piece % 8)), __ATOMIC_RELEASE);
+}
+
+void PieceJournal::clear(size_t piece) {
+    __atomic_fetch_and(&bits[piece / 8], (uint8_t)~(0x80 >> (piece % 8)), __ATOMIC_RELEASE);
+}
+
+size_t PieceJournal::count() const {
+    size_t total = 0;
+    for (size_t i = 0; i < bitfield_size(pieces); ++i) {
+        total += __builtin_popcount(__atomic_load_n(&bits[i], __ATOMIC_ACQUIRE));
+    }
+    return total;
+}
+
+size_t PieceJournal::first_missing() const {
+    for (size_t i = 0; i < bitfield_size(pieces); ++i) {
+        uint8_t byte = __atomic_load_n(&bits[i], __ATOMIC_ACQUIRE);
+        if (byte == 0xff) continue;
+        for (size_t piece = i * 8; piece < min(pieces, i * 8 + 8); ++piece) {
+            if (!has(piece)) return piece;
+        }
+    }
+    return pieces;
+}
+
+// the mapping stays until the last owner lets go, show_downloads may still be reading it
+void PieceJournal::remove() {
+    if (!persistent) return;
+    persistent = false;
+    if (unlink(path.c_str()) != 0 && errno != ENOENT) perror(("unlink " + path).c_str());
+}
@@ -0,0 +1,571 @@
+#include "./download_header.h"
+using namespace std;
+
+//-------------------------------------------------------Piece Scheduler----------------------------------------------------------//
+
+PieceScheduler::PieceScheduler(int total_pieces, uint64_t piece_size, uint64_t file_size, const vector<string>& seeders,
+                               const map<string, Bitfield>& seeder_pieces)
+    : pending(seeders.size() + 1), queued(total_pieces, 0), availability(total_pieces, 0), settled(total_pieces, 0),
+      seeders(seeders), unannounced(seeders.begin(), seeders.end()), whole_only(total_pieces, 0),
+      total_pieces(total_pieces), piece_size(piece_size), file_size(file_size),
+      blocks_per_piece(piece_size >= SPLIT_PIECE_MIN_SIZE ? (int)((piece_size + SPLIT_BLOCK_SIZE - 1) / SPLIT_BLOCK_SIZE) : 1) {
+    for (const string& seeder : seeders) {
+        auto it = seeder_pieces.find(seeder);
+        if (it != seeder_pieces.end()) this->seeder_pieces[seeder] = it->second;
+        for (int piece = 0; piece < total_pieces; ++piece) {
+            if (holds(seeder, piece)) availability[piece]++;
+        }
+    }
+}
+
+bool PieceScheduler::holds(const string& seeder, int piece) {
+    auto it = seeder_pieces.find(seeder);
+    return it == seeder_pieces.end() || bitfield_has(it->second, piece);
+}
+
+// pieces retried after a failure go to the front of their bucket
+void PieceScheduler::enqueue(int piece, bool front) {
+    queued[piece] = 1;
+    if (front) pending[availability[piece]].push_front(piece);
+    else pending[availability[piece]].push_back(piece);
+}
+
+void PieceScheduler::change_availability(int piece, int delta) {
+    availability[piece] += delta;
+    if (queued[piece]) enqueue(piece, false);
+}
+
+// give up every pending piece no live seeder can deliver any more
+vector<int> PieceScheduler::drop_unobtainable() {
+    vector<int> given_up;
+    for (size_t count = 0; count < pending.size(); ++count) {
+        deque<int>& bucket = pending[count];
+        for (auto it = bucket.begin(); it != bucket.end();) {
+            int piece = *it;
+            if (!queued[piece] || availability[piece] != (int)count) {
+                it = bucket.erase(it);
+            } else if (failed_everywhere(piece)) {
+                queued[piece] = 0;
+                settled[piece] = 1;
+                split.erase(piece);
+                given_up.push_back(piece);
+                resolved++;
+                it = bucket.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    return given_up;
+}
+
+vector<int> PieceScheduler::add_pieces(const vector<int>& pieces) {
+    vector<int> given_up;
+    {
+        lock_guard<mutex> lock(m);
+        known_pieces += pieces.size();
+        for (int piece : pieces) {
+            if (failed_everywhere(piece)) {
+                settled[piece] = 1;
+                given_up.push_back(piece);
+                resolved++;
+            } else {
+                enqueue(piece, false);
+            }
+        }
+    }
+    cv.notify_all();
+    return given_up;
+}
+
+void PieceScheduler::abandon_pieces(int count) {
+    {
+        lock_guard<mutex> lock(m);
+        known_pieces += count;
+        resolved += count;
+    }
+    cv.notify_all();
+}
+
+void PieceScheduler::settle_pieces(const vector<int>& pieces) {
+    {
+        lock_guard<mutex> lock(m);
+        known_pieces += pieces.size();
+        for (int piece : pieces) settled[piece] = 1;
+        resolved += pieces.size();
+    }
+    cv.notify_all();
+}
+
+bool PieceScheduler::usable_by(int piece, const string& seeder) {
+    if (!holds(seeder, piece)) return false;
+    auto it = failed_by.find(piece);
+    return it == failed_by.end() || it->second.count(seeder) == 0;
+}
+
+// while a seeder has not announced its pieces the tracker's bitfield may be stale, so nothing is given up yet
+bool PieceScheduler::failed_everywhere(int piece) {
+    if (!unannounced.empty()) return false;
+    for (const string& seeder : seeders) {
+        if (dead_seeders.count(seeder) == 0 && usable_by(piece, seeder)) return false;
+    }
+    return true;
+}
+
+// seconds until `seeder` would deliver one more piece or block, 0 while it is not measured yet
+double PieceScheduler::expected_finish(const string& seeder) {
+    const SeederSpeed& speed = speeds[seeder];
+    if (speed.requests_per_sec <= 0) return 0;
+    return speed.rtt_sec + (speed.outstanding + 1) / speed.requests_per_sec;
+}
+
+// true when the rest of the swarm drains the remaining pieces before `seeder` could deliver one
+// more, and another live seeder holding `piece` would deliver it sooner
+bool PieceScheduler::better_left_to_others(int piece, const string& seeder) {
+    double own = expected_finish(seeder);
+    if (own == 0) return false;
+
+    double swarm_rate = 0;
+    for (const auto& [name, speed] : speeds) {
+        if (dead_seeders.count(name) == 0) swarm_rate += speed.requests_per_sec;
+    }
+    // requests for the pieces in flight, pending and not yet known
+    int remaining = (total_pieces - resolved) * blocks_per_piece;
+    if (swarm_rate <= 0 || own <= remaining / swarm_rate) return false;
+
+    for (const string& other : seeders) {
+        if (other == seeder || dead_seeders.count(other) > 0 || !usable_by(piece, other)) continue;
+        double theirs = expected_finish(other);
+        if (theirs > 0 && theirs < own) return true;
+    }
+    return false;
+}
+
+bool PieceScheduler::splits(int piece) {
+    return blocks_per_piece > 1 && !whole_only[piece];
+}
+
+int PieceScheduler::block_count(int piece) {
+    uint64_t length = min(piece_size, file_size - (uint64_t)piece * piece_size);
+    return (int)((length + SPLIT_BLOCK_SIZE - 1) / SPLIT_BLOCK_SIZE);
+}
+
+uint64_t PieceScheduler::request_size() const {
+    return blocks_per_piece > 1 ? SPLIT_BLOCK_SIZE : piece_size;
+}
+
+// first block of a split piece nobody has received or is fetching, -1 if none
+static int free_block(const vector<char>& received, const vector<unordered_set<string>>& fetching) {
+    for (size_t block = 0; block < received.size(); ++block) {
+        if (!received[block] && fetching[block].empty()) return (int)block;
+    }
+    return -1;
+}
+
+bool PieceScheduler::lacks_unsettled(const string& seeder) {
+    for (int piece = 0; piece < total_pieces; ++piece) {
+        if (!settled[piece] && !holds(seeder, piece)) return true;
+    }
+    return false;
+}
+
+bool PieceScheduler::next_request(const string& seeder, PieceRequest& request, bool wait) {
+    unique_lock<mutex> lock(m);
+    auto refresh_at = chrono::steady_clock::now() + chrono::seconds(BITFIELD_REFRESH_SEC);
+    while (true) {
+        // pieces already started are finished first, by every seeder that holds them
+        if (take_block(seeder, request)) return true;
+        // rarest first; within a bucket the order is random because pieces are added shuffled
+        for (size_t count = 1; count < pending.size(); ++count) {
+            deque<int>& bucket = pending[count];
+            for (auto it = bucket.begin(); it != bucket.end();) {
+                int candidate = *it;
+                if (!queued[candidate] || availability[candidate] != (int)count) {
+                    it = bucket.erase(it);
+                    continue;
+                }
+                if (usable_by(candidate, seeder) && !better_left_to_others(candidate, seeder)) {
+                    bucket.erase(it);
+                    queued[candidate] = 0;
+                    request = PieceRequest{candidate, WHOLE_PIECE};
+                    if (!splits(candidate)) {
+                        hand_out(candidate, seeder);
+                        return true;
+                    }
+                    // a split piece back from the queue keeps the blocks it already has
+                    SplitPiece& blocks = split[candidate];
+                    if (blocks.received.empty()) {
+                        int count = block_count(candidate);
+                        blocks.fetching.resize(count);
+                        blocks.received.assign(count, 0);
+                        blocks.blocks_left = count;
+                    }
+                    request.block = free_block(blocks.received, blocks.fetching);
+                    hand_out_block(candidate, request.block, seeder);
+                    return true;
+                }
+                ++it;
+            }
+        }
+        if (take_duplicate(seeder, request)) return true;
+        // a seeder with nothing to do stays until every piece is settled, pieces may still come back
+        // to it or, for a partial seeder, be verified there later
+        if (!wait || resolved >= total_pieces) return false;
+        if (cv.wait_until(lock, refresh_at) == cv_status::timeout) {
+            if (lacks_unsettled(seeder)) return false;
+            refresh_at = chrono::steady_clock::now() + chrono::seconds(BITFIELD_REFRESH_SEC);
+        }
+    }
+}
+
+void PieceScheduler::hand_out(int piece, const string& seeder) {
+    fetching[piece].insert(seeder);
+    in_flight++;
+    speeds[seeder].outstanding++;
+}
+
+void PieceScheduler::hand_out_block(int piece, int block, const string& seeder) {
+    split[piece].fetching[block].insert(seeder);
+    hand_out(piece, seeder);
+}
+
+// `seeder` is done with the piece, unless another of its blocks is still in flight there
+void PieceScheduler::stop_fetching(int piece, const string& seeder) {
+    auto it = split.find(piece);
+    if (it != split.end()) {
+        for (const unordered_set<string>& fetchers : it->second.fetching) {
+            if (fetchers.count(seeder) > 0) return;
+        }
+    }
+    fetching[piece].erase(seeder);
+}
+
+// `seeder` no longer fetches the block
+void PieceScheduler::release_block(int piece, int block, const string& seeder) {
+    in_flight--;
+    speeds[seeder].outstanding--;
+    auto it = split.find(piece);
+    if (it != split.end()) it->second.fetching[block].erase(seeder);
+    stop_fetching(piece, seeder);
+}
+
+// an unclaimed block of a split piece other seeders are fetching
+bool PieceScheduler::take_block(const string& seeder, PieceRequest& request) {
+    for (auto& [piece, blocks] : split) {
+        if (settled[piece] || queued[piece] || claimed_by.count(piece) > 0 || !splits(piece)) continue;
+        int block = free_block(blocks.received, blocks.fetching);
+        if (block < 0 || !usable_by(piece, seeder)) continue;
+        request = PieceRequest{piece, block};
+        hand_out_block(piece, block, seeder);
+        return true;
+    }
+    return false;
+}
+
+// endgame: the unsettled piece, or block of a split piece, fetched by the fewest seeders that
+// `seeder` holds and is not fetching yet
+bool PieceScheduler::take_duplicate(const string& seeder, PieceRequest& request) {
+    if (known_pieces < total_pieces || total_pieces - resolved > ENDGAME_PIECES) return false;
+    size_t fewest = SIZE_MAX;
+    for (const auto& [candidate, fetchers] : fetching) {
+        if (settled[candidate] || queued[candidate] || claimed_by.count(candidate) > 0 ||
+            !usable_by(candidate, seeder)) continue;
+        if (!splits(candidate)) {
+            if (fetchers.count(seeder) > 0 || fetchers.size() >= fewest) continue;
+            fewest = fetchers.size();
+            request = PieceRequest{candidate, WHOLE_PIECE};
+            continue;
+        }
+        auto it = split.find(candidate);
+        if (it == split.end()) continue;
+        const SplitPiece& blocks = it->second;
+        for (size_t block = 0; block < blocks.received.size(); ++block) {
+            const unordered_set<string>& block_fetchers = blocks.fetching[block];
+            if (blocks.received[block] || block_fetchers.count(seeder) > 0 || block_fetchers.size() >= fewest) continue;
+            fewest = block_fetchers.size();
+            request = PieceRequest{candidate, (int)block};
+        }
+    }
+    if (fewest == SIZE_MAX) return false;
+    if (request.block == WHOLE_PIECE) hand_out(request.piece, seeder);
+    else hand_out_block(request.piece, request.block, seeder);
+    return true;
+}
+
+// nobody fetches an unsettled piece any more: back to the queue, or given up (returns true then)
+bool PieceScheduler::requeue_if_orphaned(int piece) {
+    auto it = fetching.find(piece);
+    if (it != fetching.end() && !it->second.empty()) return false;
+    fetching.erase(piece);
+    // the blocks a split piece received so far are kept for whoever takes it next
+    if (settled[piece] || !splits(piece)) split.erase(piece);
+    if (settled[piece] || claimed_by.count(piece) > 0 || queued[piece]) return false;
+    if (failed_everywhere(piece)) {
+        settled[piece] = 1;
+        split.erase(piece);
+        resolved++;
+        return true;
+    }
+    enqueue(piece, true);     // retry it soon on another seeder
+    return false;
+}
+
+bool PieceScheduler::claim(int piece, const string& seeder) {
+    lock_guard<mutex> lock(m);
+    if (settled[piece] || claimed_by.count(piece) > 0) return false;
+    claimed_by[piece] = seeder;
+    return true;
+}
+
+bool PieceScheduler::claim_in_place(int piece, const string& seeder) {
+    lock_guard<mutex> lock(m);
+    if (known_pieces >= total_pieces && total_pieces - resolved <= ENDGAME_PIECES) return false;
+    auto it = fetching.find(piece);
+    if (it != fetching.end() && it->second.size() > 1) return false;
+    if (settled[piece] || claimed_by.count(piece) > 0) return false;
+    claimed_by[piece] = seeder;
+    return true;
+}
+
+void PieceScheduler::piece_done(int piece, const string& seeder) {
+    {
+        lock_guard<mutex> lock(m);
+        in_flight--;
+        speeds[seeder].outstanding--;
+        stop_fetching(piece, seeder);
+        if (fetching[piece].empty()) {
+            fetching.erase(piece);
+            split.erase(piece);
+        }
+        claimed_by.erase(piece);
+        if (!settled[piece]) {
+            settled[piece] = 1;
+            resolved++;
+        }
+        failed_by.erase(piece);
+    }
+    cv.notify_all();
+}
+
+bool PieceScheduler::piece_failed(int piece, const string& seeder) {
+    bool given_up;
+    {
+        lock_guard<mutex> lock(m);
+        in_flight--;
+        speeds[seeder].outstanding--;
+        stop_fetching(piece, seeder);
+        auto claim = claimed_by.find(piece);
+        if (claim != claimed_by.end() && claim->second == seeder) claimed_by.erase(claim);
+        // a split piece does not tell which block was bad, it is fetched whole from now on
+        if (splits(piece)) whole_only[piece] = 1;
+        else failed_by[piece].insert(seeder);
+        given_up = requeue_if_orphaned(piece);
+    }
+    cv.notify_all();
+    return given_up;
+}
+
+bool PieceScheduler::piece_abandoned(int piece, const string& seeder) {
+    bool given_up;
+    {
+        lock_guard<mutex> lock(m);
+        in_flight--;
+        speeds[seeder].outstanding--;
+        stop_fetching(piece, seeder);
+        given_up = requeue_if_orphaned(piece);
+    }
+    cv.notify_all();
+    return given_up;
+}
+
+bool PieceScheduler::claim_block(int piece, int block) {
+    lock_guard<mutex> lock(m);
+    auto it = split.find(piece);
+    if (settled[piece] || claimed_by.count(piece) > 0 || !splits(piece) || it == split.end()) return false;
+    if (it->second.received[block]) return false;
+    it->second.received[block] = 1;
+    return true;
+}
+
+bool PieceScheduler::block_done(int piece, int block, const string& seeder) {
+    bool last;
+    {
+        lock_guard<mutex> lock(m);
+        auto it = split.find(piece);
+        last = it != split.end() && --it->second.blocks_left == 0;
+        if (last) {
+            // its request stays in flight for the whole piece until that is verified and written
+            it->second.fetching[block].erase(seeder);
+            claimed_by[piece] = seeder;
+        } else {
+            release_block(piece, block, seeder);
+            requeue_if_orphaned(piece);
+        }
+    }
+    cv.notify_all();
+    return last;
+}
+
+bool PieceScheduler::block_failed(int piece, int block, const string& seeder) {
+    bool given_up;
+    {
+        lock_guard<mutex> lock(m);
+        release_block(piece, block, seeder);
+        failed_by[piece].insert(seeder);
+        given_up = requeue_if_orphaned(piece);
+    }
+    cv.notify_all();
+    return given_up;
+}
+
+bool PieceScheduler::block_abandoned(int piece, int block, const string& seeder, bool claimed) {
+    bool given_up;
+    {
+        lock_guard<mutex> lock(m);
+        auto it = split.find(piece);
+        if (claimed && it != split.end()) it->second.received[block] = 0;
+        release_block(piece, block, seeder);
+        given_up = requeue_if_orphaned(piece);
+    }
+    cv.notify_all();
+    return given_up;
+}
+
+bool PieceScheduler::finished(int piece) {
+    lock_guard<mutex> lock(m);
+    return settled[piece] || claimed_by.count(piece) > 0;
+}
+
+bool PieceScheduler::done() {
+    lock_guard<mutex> lock(m);
+    return resolved >= total_pieces;
+}
+
+bool PieceScheduler::endgame() {
+    lock_guard<mutex> lock(m);
+    return known_pieces >= total_pieces && total_pieces - resolved <= ENDGAME_PIECES;
+}
+
+vector<int> PieceScheduler::seeder_gone(const string& seeder, const vector<PieceRequest>& unfinished) {
+    vector<int> given_up;
+    {
+        lock_guard<mutex> lock(m);
+        unannounced.erase(seeder);
+        if (dead_seeders.insert(seeder).second) {
+            for (int piece = 0; piece < total_pieces; ++piece) {
+                if (holds(seeder, piece)) change_availability(piece, -1);
+            }
+        }
+        for (const PieceRequest& request : unfinished) {
+            int piece = request.piece;
+            if (request.block != WHOLE_PIECE) {
+                release_block(piece, request.block, seeder);
+            } else {
+                in_flight--;
+                stop_fetching(piece, seeder);
+                // a piece received in place is claimed while its bytes arrive
+                auto claim = claimed_by.find(piece);
+                if (claim != claimed_by.end() && claim->second == seeder) claimed_by.erase(claim);
+            }
+            if (requeue_if_orphaned(piece)) given_up.push_back(piece);
+        }
+        speeds[seeder].outstanding = 0;
+        for (int piece : drop_unobtainable()) given_up.push_back(piece);
+    }
+    cv.notify_all();
+    return given_up;
+}
+
+vector<int> PieceScheduler::set_seeder_pieces(const string& seeder, const Bitfield& bits) {
+    vector<int> given_up;
+    {
+        lock_guard<mutex> lock(m);
+        if (dead_seeders.count(seeder) > 0) return given_up;
+        for (int piece = 0; piece < total_pieces; ++piece) {
+            bool had = holds(seeder, piece), has = bitfield_has(bits, piece);
+            if (had != has) change_availability(piece, has ? 1 : -1);
+        }
+        seeder_pieces[seeder] = bits;
+        unannounced.erase(seeder);
+        given_up = drop_unobtainable();
+    }
+    cv.notify_all();
+    return given_up;
+}
+
+void PieceScheduler::report_speed(const string& seeder, double requests_per_sec, double rtt_sec) {
+    {
+        lock_guard<mutex> lock(m);
+        SeederSpeed& speed = speeds[seeder];
+        speed.requests_per_sec = requests_per_sec;
+        speed.rtt_sec = rtt_sec;
+    }
+    // a faster estimate may free pieces a slower seeder is waiting to be left
+    cv.notify_all();
+}
+
+bool PieceScheduler::wait_until_finished(chrono::seconds timeout) {
+    unique_lock<mutex> lock(m);
+    return cv.wait_for(lock, timeout, [this] { return resolved >= total_pieces; });
+}
+
+//-------------------------------------------------------Local Pieces----------------------------------------------------------//
+
+void LocalPieces::track(const string& path, size_t total_pieces) {
+    lock_guard<mutex> lock(m);
+    files[path].assign(bitfield_size(total_pieces), 0);
+}
+
+void LocalPieces::mark(const string& path, int piece) {
+    lock_guard<mutex> lock(m);
+    auto it = files.find(path);
+    if (it != files.end()) bitfield_set(it->second, piece);
+}
+
+void LocalPieces::untrack(const string& path) {
+    lock_guard<mutex> lock(m);
+    files.erase(path);
+}
+
+bool LocalPieces::bitfield(const string& path, Bitfield& bits) {
+    lock_guard<mutex> lock(m);
+    auto it = files.find(path);
+    if (it == files.end()) return false;
+    bits = it->second;
+    return true;
+}
+
+bool LocalPieces::missing(const string& path, int piece) {
+    lock_guard<mutex> lock(m);
+    auto it = files.find(path);
+    return it != files.end() && !bitfield_has(it->second, piece);
+}
+
+LocalPieces& local_pieces() {
+    static LocalPieces* instance = new LocalPieces();
+    return *instance;
+}
+
+//-------------------------------------------------------Pipeline Tuner----------------------------------------------------------//
+
+static double ewma(double current, double sample) {
+    return current == 0 ? sample : 0.8 * current + 0.2 * sample;
+}
+
+void PipelineTuner::on_rtt_sample(double seconds) {
+    if (seconds > 0) rtt_sec = ewma(rtt_sec, seconds);
+}
+
+void PipelineTuner::on_transfer_sample(uint64_t bytes, double seconds) {
+    if (bytes > 0 && seconds > 0) bytes_per_sec = ewma(bytes_per_sec, bytes / seconds);
+}
+
+int PipelineTuner::depth(uint64_t piece_size, int configured) const {
+    if (configured > 0) return configured;
+    if (rtt_sec == 0 || bytes_per_sec == 0 || piece_size == 0) return PIPELINE_INITIAL_DEPTH;
+
+    // enough pieces to cover one round trip, plus one being received
+    double bdp = bytes_per_sec * rtt_sec;
+    int depth = (int)ceil(bdp / (double)piece_size) + 1;
+    return max(PIPELINE_MIN_DEPTH, min(PIPELINE_MAX_DEPTH, depth));
+}
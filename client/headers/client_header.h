@@ -7,8 +7,13 @@
 #include <string>
 #include <mutex>
 #include <netinet/in.h>
+#include <sys/socket.h>
 #include "./utils_header.h"
 #include "./file_header.h"
+#include "./peer_header.h"
+#include "./download_header.h"
+#include "./server_header.h"
+#include "./disk_header.h"
 using namespace std;
 
 
@@ -16,11 +21,73 @@ struct DownloadTask {
     string result;
     mutex m;
     bool done = false;
-    int total_pieces = 0;
-    int completed_pieces = 0;
+    shared_ptr<PieceJournal> pieces;    // progress, read without a lock by show_downloads
     DownloadTask() : result("not started"), done(false) {}
 };
 
+// first bytes of a piece whose connection broke halfway, the next seeder sends only the rest
+struct PartialPiece {
+    PieceBuffer data;
+    PieceProgress progress;
+};
+
+// shared state of one file download, handed to every per-seeder download loop
+struct DownloadJob {
+    FileInfo finfo;
+    string destination;
+    string shared_path;                 // destination's real path, verified pieces are announced under it
+    bool partial_seeder = false;        // the tracker lists us as a seeder of the verified pieces
+    Bitfield announced_pieces;          // the verified pieces the tracker was last told about
+    shared_ptr<OpenFile> dest_file;     // from the fd cache, held for the whole download
+    int dest_fd = -1;                   // dest_file's descriptor, pieces are written at their offset
+    int dest_slot = -1;                 // registered slot of dest_fd in the piece writer, -1 if none
+    unique_ptr<MappedFile> dest_map;    // P2P_MMAP_WRITES: pieces are received in place, null otherwise
+    shared_ptr<PieceScheduler> scheduler;
+    shared_ptr<PieceJournal> journal;   // pieces written so far, lets a later download_file resume
+    mutex partial_mutex;
+    unordered_map<int, PartialPiece> partial_pieces;    // by piece index, until a seeder resumes it
+    unordered_map<int, PieceBuffer> split_pieces;       // blocks of split pieces received so far, by piece index
+    mutex session_mutex;
+    unordered_set<int> session_socks;   // open seeder connections, shut down once every piece is settled
+    bool sessions_closed = false;
+
+    // false once the download is settled, the new connection is not needed any more
+    bool add_session(int sock) {
+        lock_guard<mutex> lock(session_mutex);
+        if (sessions_closed) return false;
+        session_socks.insert(sock);
+        return true;
+    }
+    // before the socket is closed, so close_sessions never touches a reused descriptor
+    void remove_session(int sock) {
+        lock_guard<mutex> lock(session_mutex);
+        session_socks.erase(sock);
+    }
+    // loops still receiving duplicates of settled pieces see their connection break and return
+    void close_sessions() {
+        lock_guard<mutex> lock(session_mutex);
+        sessions_closed = true;
+        for (int sock : session_socks) shutdown(sock, SHUT_RDWR);
+    }
+
+    uint64_t piece_length(int piece_index) const {
+        uint64_t offset = (uint64_t)piece_index * finfo.piece_size;
+        return min(finfo.piece_size, finfo.size - offset);
+    }
+    // bytes of one block of a split piece, or of the whole piece for WHOLE_PIECE
+    uint64_t request_length(int piece_index, int block) const {
+        uint64_t length = piece_length(piece_index);
+        if (block == WHOLE_PIECE) return length;
+        return min(SPLIT_BLOCK_SIZE, length - (uint64_t)block * SPLIT_BLOCK_SIZE);
+    }
+};
+
+// a downloading partial seeder tells the tracker about newly verified pieces this often
+const int PARTIAL_ANNOUNCE_SEC = 10;
+
+// a piece hash stream the downloader can no longer follow is dropped until the tracker is quiet this long
+const int TRACKER_STREAM_QUIET_MS = 500;
+
 class Client {
 private:
     const int max_tracker = 3;
@@ -41,21 +108,23 @@ private:
     bool set_tracker_address();
     bool connect_to_tracker();
     void start_client_command_loop();
-    void server_listener(int server_fd, struct sockaddr_in address, socklen_t addrlen);
+    unique_ptr<PeerServer> peer_server;
+
     bool start_as_listener();
-    void handle_client(int client_sock, mutex &file_mutex);
-    void assign_task_to_thread(int client_socket,mutex &file_mutex);
     void reset_tracker();
     string handle_command(string command);
     string file_upload_command(string command);
 
-    string file_download_command(string command, shared_ptr<DownloadTask> task_ptr, shared_ptr<mutex> results_mutex);
-    void assign_download_task(string piece_sha, shared_ptr<std::map<string, Address>> seeder_ptr, int piece_index, shared_ptr<std::map<string, string>> file_path_map_ptr, string destination_file_name, uint64_t piece_size, uint64_t total_size, shared_ptr<std::unordered_map<int,bool>> download_results, shared_ptr<std::mutex> file_mutex, shared_ptr<DownloadTask> download_task, shared_ptr<std::mutex> results_mutex);
+    string file_download_command(string command, shared_ptr<DownloadTask> task_ptr);
+    future<void> assign_seeder_task(shared_ptr<DownloadJob> job, const string& seeder);
     string receive_full_file_data(int sock);
-    bool download_piece(string piece_sha, shared_ptr<std::map<string, Address>> seeder_list_ptr, int piece_index, shared_ptr<std::map<string, string>> file_path_map_ptr, const string destination_file_name, uint64_t piece_size, uint64_t total_size, shared_ptr<std::mutex> file_mutex);
-    int connect_with_timeout(const std::string& ip, int port, int timeout_sec);
-    bool receive_piece(int sock, string& piece_content, uint64_t piece_size);
-    bool write_content(const string file_path, int piece_index, const string& content, uint64_t piece_size, shared_ptr<std::mutex> file_mutex);
+    bool receive_hash_chunk(int sock, vector<Digest>& piece_SHA, size_t expected_first, size_t& count);
+    void download_from_seeder(shared_ptr<DownloadJob> job, const string& seeder);
+    void complete_piece(DownloadJob& job, int piece_index, const string& seeder, bool success);
+    void deliver_block(shared_ptr<DownloadJob> job, int piece_index, int block, const string& seeder, const PieceBuffer& data);
+    bool piece_on_disk(DownloadJob& job, int piece_index);
+    bool register_partial_seeder(DownloadJob& job);
+    void withdraw_partial_seeder(DownloadJob& job);
 
 public:
     Client(const string& ip, int port, const string& tracker);
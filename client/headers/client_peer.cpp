@@ -0,0 +1,184 @@
+#include "./peer_header.h"
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cstring>
+using namespace std;
+
+//-------------------------------------------------------Frame encoding----------------------------------------------------------//
+
+void encode_frame_header(const PieceFrameHeader& header, char* out) {
+    uint32_t status = htonl(header.status);
+    uint32_t index = htonl(header.piece_index);
+    uint64_t length = htonll(header.length);
+    memcpy(out, &status, 4);
+    memcpy(out + 4, &index, 4);
+    memcpy(out + 8, &length, 8);
+}
+
+PieceFrameHeader decode_frame_header(const char* in) {
+    uint32_t status, index;
+    uint64_t length;
+    memcpy(&status, in, 4);
+    memcpy(&index, in + 4, 4);
+    memcpy(&length, in + 8, 8);
+    return PieceFrameHeader{ntohl(status), ntohl(index), ntohll(length)};
+}
+
+//-------------------------------------------------------Socket helpers----------------------------------------------------------//
+
+bool send_all(int sock, const char* data, size_t len, int flags) {
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t n = send(sock, data + sent, len - sent, flags | MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        sent += (size_t)n;
+    }
+    return true;
+}
+
+bool recv_all(int sock, char* data, size_t len) {
+    size_t received = 0;
+    while (received < len) {
+        ssize_t n = recv(sock, data + received, len - received, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        received += (size_t)n;
+    }
+    return true;
+}
+
+// this function connect to seeder with timeout if not connected in give time then try with other seeder
+int connect_with_timeout(const string& ip, int port, int timeout_sec) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip.c_str(), &addr.sin_addr) <= 0) {
+        perror("inet_pton");
+        close(sock);
+        return -1;
+    }
+
+    int flags = fcntl(sock, F_GETFL, 0);
+    fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        if (errno != EINPROGRESS) {
+            perror("connect");
+            close(sock);
+            return -1;
+        }
+        pollfd pfd{sock, POLLOUT, 0};
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (poll(&pfd, 1, timeout_sec * 1000) <= 0 ||
+            getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+            cerr << "connect to " << ip << ":" << port << " failed or timed out\n";
+            close(sock);
+            return -1;
+        }
+    }
+    fcntl(sock, F_SETFL, flags);
+
+    // requests are tiny, do not let Nagle hold them back
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    // a stalled seeder breaks the session instead of blocking its download loop forever
+    timeval timeout{PEER_RECV_TIMEOUT_SEC, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    return sock; // success
+}
+
+//-------------------------------------------------------Peer Session----------------------------------------------------------//
+
+PeerSession::PeerSession(const string& seeder, int sock) : seeder(seeder), sock(sock) {}
+
+PeerSession::~PeerSession() {
+    if (sock >= 0) close(sock);
+}
+
+bool PeerSession::request_piece(const string& file_path, int piece_index, uint64_t piece_size) {
+    string req = "get_piece " + file_path + " " + to_string(piece_index) + " " + to_string(piece_size) + "\n";
+    return send_all(sock, req.c_str(), req.size());
+}
+
+bool PeerSession::request_block(const string& file_path, int piece_index, uint64_t offset, uint64_t length, uint64_t piece_size) {
+    string req = "get_block " + file_path + " " + to_string(piece_index) + " " + to_string(offset) + " " +
+                 to_string(length) + " " + to_string(piece_size) + "\n";
+    return send_all(sock, req.c_str(), req.size());
+}
+
+bool PeerSession::cancel_piece(const string& file_path, int piece_index) {
+    string req = "cancel " + file_path + " " + to_string(piece_index) + "\n";
+    return send_all(sock, req.c_str(), req.size());
+}
+
+bool PeerSession::request_bitfield(const string& file_path, uint64_t piece_size) {
+    string req = "get_bitfield " + file_path + " " + to_string(piece_size) + "\n";
+    return send_all(sock, req.c_str(), req.size());
+}
+
+PieceResult PeerSession::receive_bitfield(size_t total_pieces, Bitfield& bits) {
+    char raw[PIECE_FRAME_HEADER_SIZE];
+    if (!recv_all(sock, raw, sizeof(raw))) return PieceResult::BROKEN;
+
+    PieceFrameHeader header = decode_frame_header(raw);
+    if (header.status != PIECE_OK) {
+        return header.length == 0 ? PieceResult::REJECTED : PieceResult::BROKEN;
+    }
+    if (header.length != bitfield_size(total_pieces)) {
+        cerr << "Bitfield size mismatch from " << seeder << "\n";
+        return PieceResult::BROKEN;
+    }
+
+    bits.resize(header.length);
+    if (!recv_all(sock, (char*)bits.data(), header.length)) return PieceResult::BROKEN;
+    return PieceResult::RECEIVED;
+}
+
+PieceResult PeerSession::receive_piece_header(int piece_index, uint64_t expected_size,
+                                              chrono::steady_clock::time_point* header_time) {
+    char raw[PIECE_FRAME_HEADER_SIZE];
+    if (!recv_all(sock, raw, sizeof(raw))) return PieceResult::BROKEN;
+    if (header_time) *header_time = chrono::steady_clock::now();
+
+    PieceFrameHeader header = decode_frame_header(raw);
+    if (header.piece_index != (uint32_t)piece_index) {
+        cerr << "Unexpected piece " << header.piece_index << " from " << seeder << ", wanted " << piece_index << "\n";
+        return PieceResult::BROKEN;
+    }
+    if (header.status == PIECE_CANCELLED && header.length == 0) return PieceResult::CANCELLED;
+    if (header.status != PIECE_OK) {
+        return header.length == 0 ? PieceResult::REJECTED : PieceResult::BROKEN;
+    }
+    if (header.length != expected_size) {
+        cerr << "Piece size mismatch\n";
+        return PieceResult::BROKEN;
+    }
+    return PieceResult::RECEIVED;
+}
+
+bool PeerSession::receive_piece_data(char* piece, uint64_t length, PieceProgress& progress, bool hash) {
+    while (progress.received < length) {
+        char* out = piece + progress.received;
+        ssize_t n = recv(sock, out, min<uint64_t>(length - progress.received, PIECE_RECV_CHUNK), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        if (hash) SHA256_Update(&progress.sha, out, n);
+        progress.received += (uint64_t)n;
+    }
+    return true;
+}
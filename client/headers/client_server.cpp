@@ -0,0 +1,563 @@
+#include "./server_header.h"
+#include "./config_header.h"
+#include "./utils_header.h"
+#include "./download_header.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+
+using namespace std;
+
+// copy path buffer, only allocated for connections that cannot use sendfile64
+static const size_t PEER_COPY_BUFFER_SIZE = 256 * 1024;
+
+PeerServer::PeerServer(int listen_fd, size_t loop_count) : listen_fd(listen_fd) {
+    for (size_t i = 0; i < max<size_t>(1, loop_count); ++i) {
+        loops.push_back(make_unique<Loop>());
+    }
+}
+
+PeerServer::~PeerServer() {
+    stop();
+}
+
+bool PeerServer::start() {
+    bool ring_warned = false;
+    for (auto& loop : loops) {
+        loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epoll_fd < 0) {
+            perror("epoll_create1");
+            return false;
+        }
+        // every loop watches the listener, EPOLLEXCLUSIVE wakes only one of them per connection
+        struct epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.fd = listen_fd;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+            perror("epoll_ctl listener");
+            return false;
+        }
+        setup_ring(*loop);
+        if (client_config().io_uring && loop->ring_event_fd < 0 && !ring_warned) {
+            cerr << "io_uring not available, pieces are read with pread64\n";
+            ring_warned = true;
+        }
+    }
+    for (auto& loop : loops) {
+        loop->worker = thread(&PeerServer::run, this, ref(*loop));
+    }
+    return true;
+}
+
+void PeerServer::stop() {
+    stopping = true;
+    for (auto& loop : loops) {
+        if (loop->worker.joinable()) loop->worker.join();
+    }
+}
+
+//-------------------------------------------------------Event Loop----------------------------------------------------------//
+
+void PeerServer::run(Loop& loop) {
+    const int MAX_EVENTS = 64;
+    struct epoll_event events[MAX_EVENTS];
+    auto last_sweep = chrono::steady_clock::now();
+
+    while (!stopping) {
+        // wake up at least once a second for idle connections and stop()
+        int n = epoll_wait(loop.epoll_fd, events, MAX_EVENTS, 1000);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == listen_fd) {
+                accept_connections(loop);
+                continue;
+            }
+            if (fd == loop.ring_event_fd) {
+                uint64_t count;
+                while (read(loop.ring_event_fd, &count, sizeof(count)) > 0) {}
+                on_ring_completions(loop);
+                continue;
+            }
+            auto it = loop.connections.find(fd);
+            if (it != loop.connections.end()) {
+                on_event(loop, *it->second, events[i].events);
+            }
+        }
+
+        // every read queued during this wakeup goes to the kernel in one io_uring_enter
+        if (loop.ring_unsubmitted) {
+            int ret = loop.ring.submit();
+            if (ret < 0) {
+                errno = -ret;
+                perror("io_uring_enter");
+            }
+            loop.ring_unsubmitted = false;
+        }
+
+        auto now = chrono::steady_clock::now();
+        if (now - last_sweep >= chrono::seconds(1)) {
+            sweep_idle(loop);
+            last_sweep = now;
+        }
+    }
+
+    vector<int> socks;
+    for (auto& [sock, conn] : loop.connections) socks.push_back(sock);
+    for (int sock : socks) close_connection(loop, sock);
+    if (loop.ring_event_fd >= 0) close(loop.ring_event_fd);
+    loop.ring_event_fd = -1;
+    close(loop.epoll_fd);
+    loop.epoll_fd = -1;
+}
+
+// P2P_IO_URING=1: the copy path reads through a per-loop ring into registered buffers, and the
+// ring's eventfd sits in the epoll set like any socket. Leaves ring_event_fd at -1 when unavailable.
+void PeerServer::setup_ring(Loop& loop) {
+    if (!client_config().io_uring || !loop.ring.init(PEER_RING_BUFFERS)) return;
+
+    loop.ring_memory.resize((size_t)PEER_RING_BUFFERS * PEER_COPY_BUFFER_SIZE);
+    vector<iovec> buffers;
+    for (unsigned i = 0; i < PEER_RING_BUFFERS; ++i) {
+        buffers.push_back(iovec{loop.ring_memory.data() + (size_t)i * PEER_COPY_BUFFER_SIZE, PEER_COPY_BUFFER_SIZE});
+    }
+    // unregistered buffers still work, the reads just can not use READ_FIXED
+    loop.buffers_registered = loop.ring.register_buffers(buffers);
+
+    int event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd < 0) {
+        perror("eventfd");
+        return;
+    }
+    struct epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = event_fd;
+    if (!loop.ring.register_eventfd(event_fd) || epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, event_fd, &ev) < 0) {
+        close(event_fd);
+        return;
+    }
+    loop.ring_event_fd = event_fd;
+    for (unsigned i = 0; i < PEER_RING_BUFFERS; ++i) loop.free_buffers.push_back(i);
+}
+
+void PeerServer::accept_connections(Loop& loop) {
+    while (true) {
+        int sock = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock < 0) {
+            if (errno == EINTR) continue;
+            // EAGAIN: another loop took it or the queue is drained
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept4");
+            return;
+        }
+
+        int one = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        // a quiet connection is kept for as long as the leecher wants it, keepalive finds dead hosts
+        setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+
+        auto conn = make_unique<PeerConnection>();
+        conn->sock = sock;
+        conn->last_activity = chrono::steady_clock::now();
+
+        struct epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.fd = sock;
+        if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+            perror("epoll_ctl peer");
+            close(sock);
+            continue;
+        }
+        loop.connections[sock] = move(conn);
+    }
+}
+
+void PeerServer::on_event(Loop& loop, PeerConnection& conn, uint32_t events) {
+    int sock = conn.sock;
+    bool open = !(events & EPOLLERR);
+    if (open && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))) {
+        open = read_requests(conn);
+    }
+    if (open) {
+        open = make_progress(loop, conn);
+    }
+    if (!open) {
+        close_connection(loop, sock);
+    }
+}
+
+// pull every request byte the socket has, false when the leecher closed or misbehaves
+bool PeerServer::read_requests(PeerConnection& conn) {
+    char buf[4096];
+    while (true) {
+        ssize_t n = recv(conn.sock, buf, sizeof(buf), 0);
+        if (n > 0) {
+            conn.in.append(buf, n);
+            conn.last_activity = chrono::steady_clock::now();
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        return false;
+    }
+
+    if (conn.in.size() > PEER_MAX_PENDING_INPUT) return false;
+    size_t line_end = conn.in.find('\n');
+    if (line_end == string::npos && conn.in.size() > PEER_MAX_REQUEST_LINE) return false;
+    return true;
+}
+
+// answer queued requests in order until the socket is full or the write budget is used up
+bool PeerServer::make_progress(Loop& loop, PeerConnection& conn) {
+    uint64_t budget = PEER_WRITE_BUDGET;
+    while (true) {
+        if (!conn.responding) {
+            size_t line_end = conn.in.find('\n');
+            if (line_end == string::npos) break;
+            string request = conn.in.substr(0, line_end);
+            conn.in.erase(0, line_end + 1);
+            trim_whitespace(request);
+            if (request.empty()) continue;
+            if (!start_response(conn, request)) return false;
+            if (!conn.responding) continue;     // a cancel that came too late, nothing to answer
+        }
+
+        bool blocked = false;
+        if (!write_response(loop, conn, budget, blocked)) return false;
+        if (conn.read_pending) {
+            // nothing to send until the ring delivers the next chunk, on_ring_completions resumes
+            watch_out(loop, conn, false);
+            return true;
+        }
+        if (conn.responding) {
+            // level triggered EPOLLOUT brings us back when there is room (or right away if only the budget ran out)
+            watch_out(loop, conn, true);
+            return true;
+        }
+    }
+    watch_out(loop, conn, false);
+    return true;
+}
+
+//-------------------------------------------------------Responses----------------------------------------------------------//
+
+static void set_frame(PeerConnection& conn, uint32_t status, uint32_t piece_index, uint64_t length) {
+    encode_frame_header(PieceFrameHeader{status, piece_index, length}, conn.header);
+    conn.header_sent = 0;
+    conn.remaining = length;
+    conn.responding = true;
+}
+
+// the piece size a request ends with, DEFAULT_PIECE_SIZE when an older leecher left it out; 0 if invalid
+static uint64_t requested_piece_size(const vector<string>& tokens, size_t position) {
+    if (tokens.size() <= position) return DEFAULT_PIECE_SIZE;
+    char* end = nullptr;
+    unsigned long long piece_size = strtoull(tokens[position].c_str(), &end, 10);
+    if (*end != '\0' || !valid_piece_size(piece_size)) return 0;
+    return piece_size;
+}
+
+static bool parse_u64(const string& token, uint64_t& value) {
+    char* end = nullptr;
+    errno = 0;
+    unsigned long long parsed = strtoull(token.c_str(), &end, 10);
+    if (token.empty() || token[0] == '-' || *end != '\0' || errno == ERANGE) return false;
+    value = parsed;
+    return true;
+}
+
+// parse one request and set up its frame, false for requests that are not part of the peer protocol
+bool PeerServer::start_response(PeerConnection& conn, const string& request) {
+    vector<string> tokens;
+    tokenize(request, tokens);
+    if ((tokens.size() == 2 || tokens.size() == 3) && tokens[0] == "get_bitfield") {
+        uint64_t piece_size = requested_piece_size(tokens, 2);
+        if (piece_size == 0) {
+            cerr << "Invalid piece size in request: " << request << endl;
+            return false;
+        }
+        start_bitfield_response(conn, tokens[1], piece_size);
+        return true;
+    }
+    // its get_piece was answered already, otherwise the cancel would have been consumed with it
+    if (tokens.size() == 3 && tokens[0] == "cancel") return true;
+    bool whole_piece = (tokens.size() == 3 || tokens.size() == 4) && tokens[0] == "get_piece";
+    bool block = tokens.size() == 6 && tokens[0] == "get_block";
+    if (!whole_piece && !block) {
+        cerr << "Invalid piece request: " << request << endl;
+        return false;
+    }
+
+    string file_path = tokens[1];
+    char* end = nullptr;
+    long piece_index = strtol(tokens[2].c_str(), &end, 10);
+    if (*end != '\0' || piece_index < 0 || piece_index > INT32_MAX) {
+        cerr << "Invalid piece index in request: " << request << endl;
+        return false;
+    }
+    uint64_t piece_size = requested_piece_size(tokens, block ? 5 : 3);
+    if (piece_size == 0) {
+        cerr << "Invalid piece size in request: " << request << endl;
+        return false;
+    }
+    // get_block: a byte range within the piece, the rest of a piece whose first bytes the leecher has
+    uint64_t block_offset = 0, block_length = 0;
+    if (block && (!parse_u64(tokens[3], block_offset) || !parse_u64(tokens[4], block_length) ||
+                  block_length == 0 || block_offset >= piece_size || block_length > piece_size - block_offset)) {
+        cerr << "Invalid block in request: " << request << endl;
+        return false;
+    }
+
+    // the leecher got this piece elsewhere while the request was queued here
+    string cancel_line = "cancel " + file_path + " " + tokens[2] + "\n";
+    size_t cancel_pos = conn.in.find(cancel_line);
+    if (cancel_pos != string::npos) {
+        conn.in.erase(cancel_pos, cancel_line.size());
+        set_frame(conn, PIECE_CANCELLED, piece_index, 0);
+        return true;
+    }
+
+    // a file still downloading serves only the pieces verified so far
+    if (local_pieces().missing(file_path, piece_index)) {
+        set_frame(conn, PIECE_UNAVAILABLE, piece_index, 0);
+        return true;
+    }
+
+    // descriptor and size come from the fd cache, no path lookup per piece
+    shared_ptr<OpenFile> file = fd_cache().acquire(file_path, false);
+    if (!file) {
+        set_frame(conn, PIECE_UNAVAILABLE, piece_index, 0);
+        return true;
+    }
+
+    uint64_t total_pieces = (file->size + piece_size - 1)/piece_size;
+    if ((uint64_t)piece_index >= total_pieces) {
+        set_frame(conn, PIECE_UNAVAILABLE, piece_index, 0);
+        return true;
+    }
+
+    uint64_t length = ((uint64_t)piece_index == total_pieces-1)? file->size - (uint64_t)piece_index*piece_size : piece_size;
+    if (block) {
+        // the last piece is shorter, a range past its end is answered like a missing piece
+        if (block_offset + block_length > length) {
+            set_frame(conn, PIECE_UNAVAILABLE, piece_index, 0);
+            return true;
+        }
+        length = block_length;
+    }
+
+    set_frame(conn, PIECE_OK, piece_index, length);
+    conn.file_fd = file->fd;
+    conn.file = move(file);
+    conn.offset = (off64_t)(piece_index*piece_size + block_offset);
+    conn.zero_copy = client_config().zero_copy;
+    return true;
+}
+
+// a file still downloading announces its verified pieces, any other file that opens is complete
+void PeerServer::start_bitfield_response(PeerConnection& conn, const string& file_path, uint64_t piece_size) {
+    Bitfield bits;
+    if (!local_pieces().bitfield(file_path, bits)) {
+        shared_ptr<OpenFile> file = fd_cache().acquire(file_path, false);
+        if (!file) {
+            set_frame(conn, PIECE_UNAVAILABLE, 0, 0);
+            return;
+        }
+        uint64_t total_pieces = (file->size + piece_size - 1)/piece_size;
+        bits.assign(bitfield_size(total_pieces), 0);
+        for (uint64_t piece = 0; piece < total_pieces; ++piece) bitfield_set(bits, piece);
+    }
+    conn.body.assign(bits.begin(), bits.end());
+    set_frame(conn, PIECE_OK, 0, conn.body.size());
+}
+
+// push as much of the current frame as the socket takes, `blocked` is set when it is full
+bool PeerServer::write_response(Loop& loop, PeerConnection& conn, uint64_t& budget, bool& blocked) {
+    while (conn.header_sent < PIECE_FRAME_HEADER_SIZE) {
+        // MSG_MORE lets the header leave in the same segment as the first piece bytes
+        int flags = MSG_NOSIGNAL | (conn.remaining > 0 ? MSG_MORE : 0);
+        ssize_t s = send(conn.sock, conn.header + conn.header_sent, PIECE_FRAME_HEADER_SIZE - conn.header_sent, flags);
+        if (s > 0) { conn.header_sent += s; continue; }
+        if (s < 0 && errno == EINTR) continue;
+        if (s < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { blocked = true; return true; }
+        return false;
+    }
+
+    while (conn.remaining > 0 && !conn.body.empty()) {
+        ssize_t s = send(conn.sock, conn.body.data() + conn.body.size() - conn.remaining, conn.remaining, MSG_NOSIGNAL);
+        if (s > 0) { conn.remaining -= s; continue; }
+        if (s < 0 && errno == EINTR) continue;
+        if (s < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { blocked = true; return true; }
+        return false;
+    }
+
+    while (conn.remaining > 0 && budget > 0) {
+        if (conn.zero_copy) {
+            // zero-copy path: the kernel moves the piece from page cache to the socket
+            ssize_t s = sendfile64(conn.sock, conn.file_fd, &conn.offset, min(conn.remaining, budget));
+            if (s > 0) {
+                conn.remaining -= s;
+                budget -= min<uint64_t>(budget, s);
+                conn.last_activity = chrono::steady_clock::now();
+                continue;
+            }
+            if (s < 0 && errno == EINTR) continue;
+            if (s < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { blocked = true; return true; }
+            if (s < 0 && (errno == EINVAL || errno == ENOSYS)) { conn.zero_copy = false; continue; }
+            // a leecher that went away mid-piece is not worth a message
+            if (s < 0 && errno != EPIPE && errno != ECONNRESET) perror("sendfile64");
+            return false;   // 0 means the file got shorter, the frame can not be completed
+        }
+
+        // fallback path: copy the piece through a user space buffer, pread keeps it lock free
+        if (conn.read_pending) return true;
+        if (conn.buffer_pos == conn.buffer_len) {
+            size_t chunk = min<uint64_t>(PEER_COPY_BUFFER_SIZE, conn.remaining);
+            if (start_ring_read(loop, conn, chunk)) return true;
+            ssize_t r = pread64(conn.file_fd, copy_buffer(loop, conn), chunk, conn.offset);
+            if (r <= 0) {
+                if (r < 0) perror("pread64");
+                return false;
+            }
+            conn.offset += r;
+            conn.buffer_pos = 0;
+            conn.buffer_len = r;
+        }
+        ssize_t s = send(conn.sock, copy_buffer(loop, conn) + conn.buffer_pos, conn.buffer_len - conn.buffer_pos, MSG_NOSIGNAL);
+        if (s > 0) {
+            conn.buffer_pos += s;
+            conn.remaining -= s;
+            budget -= min<uint64_t>(budget, s);
+            conn.last_activity = chrono::steady_clock::now();
+            continue;
+        }
+        if (s < 0 && errno == EINTR) continue;
+        if (s < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { blocked = true; return true; }
+        return false;
+    }
+
+    if (conn.remaining == 0) finish_response(loop, conn);
+    return true;
+}
+
+void PeerServer::finish_response(Loop& loop, PeerConnection& conn) {
+    if (conn.ring_buffer >= 0) {
+        // a read still in flight owns the buffer until its completion arrives
+        if (conn.read_pending) loop.pending_reads[conn.ring_buffer] = -1;
+        else loop.free_buffers.push_back(conn.ring_buffer);
+    }
+    conn.ring_buffer = -1;
+    conn.read_pending = false;
+    // the descriptor stays open in the fd cache for the next piece of the file
+    conn.file.reset();
+    conn.file_fd = -1;
+    conn.body.clear();
+    conn.responding = false;
+    conn.header_sent = 0;
+    conn.remaining = 0;
+    conn.buffer_pos = 0;
+    conn.buffer_len = 0;
+}
+
+//-------------------------------------------------------io_uring Reads----------------------------------------------------------//
+
+// the buffer the copy path of `conn` reads into: its registered ring buffer, or its own
+char* PeerServer::copy_buffer(Loop& loop, PeerConnection& conn) {
+    if (conn.ring_buffer >= 0) return loop.ring_memory.data() + (size_t)conn.ring_buffer * PEER_COPY_BUFFER_SIZE;
+    if (conn.buffer.empty()) conn.buffer.resize(PEER_COPY_BUFFER_SIZE);
+    return conn.buffer.data();
+}
+
+// queue the next chunk of the piece on the loop's ring, false when the caller should pread instead
+bool PeerServer::start_ring_read(Loop& loop, PeerConnection& conn, size_t chunk) {
+    if (loop.ring_event_fd < 0) return false;
+    if (conn.ring_buffer < 0) {
+        if (loop.free_buffers.empty()) return false;
+        conn.ring_buffer = loop.free_buffers.back();
+        loop.free_buffers.pop_back();
+    }
+    int buf_index = loop.buffers_registered ? conn.ring_buffer : -1;
+    if (!loop.ring.prep_read(conn.file_fd, false, copy_buffer(loop, conn), chunk, conn.offset, buf_index, conn.ring_buffer)) {
+        return false;
+    }
+    conn.read_pending = true;
+    loop.pending_reads[conn.ring_buffer] = conn.sock;
+    loop.ring_unsubmitted = true;
+    return true;
+}
+
+void PeerServer::on_ring_completions(Loop& loop) {
+    UringCompletion completion;
+    while (loop.ring.next_completion(completion)) {
+        int buffer = (int)completion.user_data;
+        auto it = loop.pending_reads.find(buffer);
+        if (it == loop.pending_reads.end()) continue;
+        int sock = it->second;
+        loop.pending_reads.erase(it);
+
+        auto conn_it = loop.connections.find(sock);
+        if (sock < 0 || conn_it == loop.connections.end()) {
+            // the leecher went away while the read was in flight
+            loop.free_buffers.push_back(buffer);
+            continue;
+        }
+        PeerConnection& conn = *conn_it->second;
+        conn.read_pending = false;
+        if (completion.res <= 0) {
+            if (completion.res < 0) {
+                errno = -completion.res;
+                perror("io_uring read");
+            }
+            close_connection(loop, sock);
+            continue;
+        }
+        conn.offset += completion.res;
+        conn.buffer_pos = 0;
+        conn.buffer_len = completion.res;
+        if (!make_progress(loop, conn)) close_connection(loop, sock);
+    }
+}
+
+//-------------------------------------------------------Connection Housekeeping----------------------------------------------------------//
+
+void PeerServer::watch_out(Loop& loop, PeerConnection& conn, bool enable) {
+    if (conn.watching_out == enable) return;
+    struct epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLRDHUP | (enable ? EPOLLOUT : 0);
+    ev.data.fd = conn.sock;
+    if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_MOD, conn.sock, &ev) == 0) {
+        conn.watching_out = enable;
+    }
+}
+
+void PeerServer::close_connection(Loop& loop, int sock) {
+    auto it = loop.connections.find(sock);
+    if (it == loop.connections.end()) return;
+    finish_response(loop, *it->second);
+    epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, sock, nullptr);
+    close(sock);
+    loop.connections.erase(it);
+}
+
+// a leecher that stops reading its pieces, or leaves a request half sent, for PEER_IDLE_TIMEOUT_SEC
+// is dropped. A connection with nothing pending is not: a leecher may wait on its scheduler for
+// minutes (slow-seeder deferral, digests still streaming, endgame) and still use it afterwards
+void PeerServer::sweep_idle(Loop& loop) {
+    auto deadline = chrono::steady_clock::now() - chrono::seconds(PEER_IDLE_TIMEOUT_SEC);
+    vector<int> idle;
+    for (auto& [sock, conn] : loop.connections) {
+        bool stalled = conn->responding || !conn->in.empty();
+        if (stalled && conn->last_activity < deadline) idle.push_back(sock);
+    }
+    for (int sock : idle) close_connection(loop, sock);
+}
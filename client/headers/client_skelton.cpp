@@ -2,41 +2,34 @@
 #include "./thread_header.h"
 #include "./utils_header.h"
 #include "./file_header.h"
+#include "./config_header.h"
+#include "./peer_header.h"
+#include "./disk_header.h"
 #include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <thread>
 #include <vector>
 #include <cstring>
 #include <unistd.h>
+#include <poll.h>
 
 #include <mutex>
 #include "client_header.h"
 
 using namespace std;
 
+// one request/reply exchange on the tracker socket at a time; a download holds it until the
+// piece hash stream is read to its end, so a command typed meanwhile never takes a chunk frame as its reply
 mutex tracker_comm_mutex;
 
-static uint64_t htonll(uint64_t v) {
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN
-    return (((uint64_t)htonl((uint32_t)(v & 0xffffffffULL))) << 32) |
-           htonl((uint32_t)(v >> 32));
-#else
-    return v;
-#endif
-}
-static uint64_t ntohll(uint64_t v) {
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN
-    return (((uint64_t)ntohl((uint32_t)(v & 0xffffffffULL))) << 32) |
-           ntohl((uint32_t)(v >> 32));
-#else
-    return v;
-#endif
-}
-
 vector<shared_ptr<DownloadTask>> download_history;
 mutex download_history_mutex;
 
+void drain_socket(int sock);
+
 
 Client::Client(const string& ip, int port, const string& tracker){
     ip_address = ip;
@@ -54,128 +47,13 @@ Client::Client(const string& ip, int port, const string& tracker){
 //-------------------------------------------------------Client as Server Act----------------------------------------------------------//
 
 
-void Client::handle_client(int client_sock, mutex &file_mutex) {
-    string client_info;
-    char small_buf[4096];
-    ssize_t bytes = recv(client_sock, small_buf, sizeof(small_buf)-1, 0);
-    if (bytes <= 0) { 
-        close(client_sock); 
-        return; 
-    }
-    client_info.assign(small_buf, (size_t)bytes);
-    trim_whitespace(client_info);
-
-    vector<string> tokens;
-    tokenize(client_info, tokens);
-    if (tokens.size() != 3 || tokens[0] != "get_piece") {
-        cerr << "Invalid get_piece request: " << client_info << endl;
-        close(client_sock);
-        return;
-    }
-
-    string file_path = tokens[1];
-    int piece_index = stoi(tokens[2]);
-
-    lock_guard<mutex> lock(file_mutex);
-    struct stat64 st{};
-    if (stat64(file_path.c_str(), &st) == -1) { 
-        perror("stat64"); close(client_sock); 
-        return; 
-    }
-
-    const uint64_t global_piece_size = 512ULL*1024ULL;
-    uint64_t total_pieces = (st.st_size + global_piece_size - 1)/global_piece_size;
-    if (piece_index >= (int)total_pieces) { 
-        close(client_sock); 
-        return; 
-    }
-
-
-    uint64_t piece_size = (piece_index == (int)total_pieces-1)? st.st_size - (uint64_t)piece_index*global_piece_size : global_piece_size;
-
-    int fd = open(file_path.c_str(), O_RDONLY);
-    if (fd < 0) { 
-        perror("open"); 
-        close(client_sock); 
-        return; 
-    }
-    off64_t offset = (off64_t)piece_index*global_piece_size;
-    if (lseek64(fd, offset, SEEK_SET) == (off64_t)-1) { 
-        perror("lseek64"); 
-        close(fd); 
-        close(client_sock); 
-        return; 
-    }
-
-    // send piece length (64-bit)
-    uint64_t net_len = htonll(piece_size);
-    if (send(client_sock, &net_len, sizeof(net_len), 0) != sizeof(net_len)) {
-        close(fd); close(client_sock); 
-        return;
-    }
-
-    char buf[1024*1024];
-    uint64_t remaining = piece_size;
-    while (remaining > 0) {
-        size_t chunk = min<uint64_t>(sizeof(buf), remaining);
-        ssize_t r = read(fd, buf, chunk);
-        if (r <= 0) { 
-            perror("read"); 
-            break; 
-        }
-        ssize_t s = send(client_sock, buf, r, 0);
-        if (s <= 0) { 
-            perror("send"); break; }
-        remaining -= (uint64_t)s;
-    }
-
-    close(fd);
-    close(client_sock);
-}
-// assign_task_to_thread: catch exceptions and ensure release_thread runs
-void Client::assign_task_to_thread(int client_socket, mutex &file_mutex) {
-    unique_lock<mutex> lock(thread_mutex);
-    thread_cv.wait(lock, [] { return is_any_thread_available(); });
-    int idx = get_available_thread();
-    lock.unlock();
-
-    thread_pool[idx] = thread([this, idx, client_socket, &file_mutex]() {
-        try {
-            handle_client(client_socket, file_mutex);
-        } catch (const exception &ex) {
-            cerr << "Exception in client handler thread: " << ex.what() << endl;
-        } catch (...) {
-            cerr << "Unknown exception in client handler thread\n";
-        }
-        release_thread(idx);
-    });
-    
-    thread_pool[idx].detach();
-}
-
-// when Other client come then make thread of it send to hnadle client
-void Client::server_listener(int server_fd, struct sockaddr_in address, socklen_t addrlen) {
-    mutex file_mutex;
-    while (true) {
-        int other_client_sock = accept(server_fd, (struct sockaddr *)&address, &addrlen);
-        if (other_client_sock < 0) {
-            continue;
-        }
-        
-        // cout<<"Accepted connection from client: " << inet_ntoa(address.sin_addr) << ":" << ntohs(address.sin_port) << endl; 
-        assign_task_to_thread(other_client_sock,file_mutex);
-
-    }
-}
-
 // start as lister on given port to accept other client request
 bool Client::start_as_listener()
 {
     int server_fd;
     struct sockaddr_in address;
-    socklen_t addrlen = sizeof(address);
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd == 0) {
+    server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server_fd < 0) {
         cerr << "Failed to create socket.\n";
         return false;
     }
@@ -198,13 +76,17 @@ bool Client::start_as_listener()
         return false;
     }
 
-    if (listen(server_fd, 3) < 0) {
+    if (listen(server_fd, SOMAXCONN) < 0) {
         cerr << "Failed to listen on socket.\n";
         return false;
     }
 
-    thread listener_thread(&Client::server_listener, this, server_fd, address, addrlen);
-    listener_thread.detach();
+    // fixed set of epoll loops serves every leecher, see server_header.h
+    peer_server = make_unique<PeerServer>(server_fd, MAX_THREADS);
+    if (!peer_server->start()) {
+        cerr << "Failed to start peer server.\n";
+        return false;
+    }
 
     return true;
 }
@@ -388,7 +270,8 @@ string Client::file_upload_command(string command) {
     }
     
     
-    string new_command = "upload_file_data " + file_data + "\n";
+    // binary FileInfo right after the command word, the length prefix delimits it
+    string new_command = "upload_file_data " + file_data;
     
     
     uint64_t msg_len = htonll(new_command.size());
@@ -412,171 +295,348 @@ string Client::file_upload_command(string command) {
 
                      //-------------------------------------- download ------------------------------------//
 
-// this function connect to seeder with timeout if not connected in give time then try with other seeder
-//----------- Client side: connect with timeout ----------
-int Client::connect_with_timeout(const string& ip, int port, int timeout_sec) {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        perror("socket");
-        return -1;
-    } 
+// ---------- Client side: settle one piece ----------
+// the piece's bit is set before the scheduler hears about it, so it is in place once
+// wait_until_finished returns even when the piece was settled on the disk writer's thread.
+// a failed or given-up piece just keeps its bit clear, a retry on another seeder may still set it.
+void Client::complete_piece(DownloadJob &job, int piece_index, const string &seeder, bool success) {
+    // the piece is written by now, so the journal never lists one that is not on disk
+    if (success) job.journal->mark(piece_index);
+    if (success) local_pieces().mark(job.shared_path, piece_index);
+    if (success) job.scheduler->piece_done(piece_index, seeder);
+    else job.scheduler->piece_failed(piece_index, seeder);
+}
 
-    sockaddr_in addr{};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    if (inet_pton(AF_INET, ip.c_str(), &addr.sin_addr) <= 0) {
-        perror("inet_pton");
-        close(sock);
-        return -1;
+// ---------- Client side: one block of a split piece ----------
+// the first copy of each block goes into the piece's buffer; whoever delivers the last block
+// verifies the whole piece and hands it to the writer
+void Client::deliver_block(shared_ptr<DownloadJob> job, int piece_index, int block, const string &seeder, const PieceBuffer &data) {
+    uint64_t length = job->piece_length(piece_index);
+    char* piece;
+    {
+        lock_guard<mutex> lock(job->partial_mutex);
+        PieceBuffer &assembled = job->split_pieces[piece_index];
+        try {
+            if (assembled.data() == nullptr) assembled = piece_buffers().acquire(length);
+        } catch (...) {
+            // nowhere to put the block, another copy of it may be fetched later
+            job->split_pieces.erase(piece_index);
+            job->scheduler->block_abandoned(piece_index, block, seeder, true);
+            throw;
+        }
+        piece = assembled.data();
     }
+    // every block is claimed once, so copies into the same piece never overlap
+    memcpy(piece + (uint64_t)block * SPLIT_BLOCK_SIZE, data.data(), data.size());
+    if (!job->scheduler->block_done(piece_index, block, seeder)) return;
 
-    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        perror("connect");
-        close(sock);
-        return -1;
+    PieceBuffer whole;
+    {
+        lock_guard<mutex> lock(job->partial_mutex);
+        auto it = job->split_pieces.find(piece_index);
+        whole = move(it->second);
+        job->split_pieces.erase(it);
     }
-
-    return sock; // success
-}
-
-// ---------- Client side: piece receive ----------
-bool Client::receive_piece(int sock_fd, string &piece_data, uint64_t expected_size) {
-    uint64_t net_size;
-    if (recv(sock_fd, &net_size, sizeof(net_size), MSG_WAITALL) != sizeof(net_size))
-        return false;
-
-    uint64_t piece_size = ntohll(net_size);
-    if (piece_size != expected_size) {
-        cerr << "Piece size mismatch\n";
-        return false;
+    PieceProgress progress;
+    SHA256_Update(&progress.sha, whole.data(), length);
+    if (progress.finish() != job->finfo.piece_SHA[piece_index]) {
+        complete_piece(*job, piece_index, seeder, false);
+        return;
     }
+    uint64_t offset = (uint64_t)piece_index * job->finfo.piece_size;
+    piece_writer().write(job->dest_fd, job->dest_slot, offset, move(whole),
+                         [this, job, piece_index, seeder](bool written) {
+                             complete_piece(*job, piece_index, seeder, written);
+                         });
+}
 
-    piece_data.resize(piece_size);
-    uint64_t bytes_received = 0;
-
-    while (bytes_received < piece_size) {
-        ssize_t chunk = recv(sock_fd, &piece_data[bytes_received], piece_size - bytes_received, 0);
-        if (chunk <= 0) return false;
-        bytes_received += static_cast<uint64_t>(chunk);
+// ---------- Client side: piece left by an earlier attempt ----------
+// the journal says the piece was written, it is used only if it still matches its digest
+bool Client::piece_on_disk(DownloadJob &job, int piece_index) {
+    uint64_t length = job.piece_length(piece_index);
+    PieceBuffer data = piece_buffers().acquire(length);
+    uint64_t done = 0;
+    while (done < length) {
+        ssize_t r = pread64(job.dest_fd, data.data() + done, length - done, (uint64_t)piece_index * job.finfo.piece_size + done);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        done += r;
     }
+    return calculate_SHA(data.data(), data.size()) == job.finfo.piece_SHA[piece_index];
+}
 
+// ---------- Client side: serve a file while it downloads ----------
+// the tracker lists us as a partial seeder right away and is told again every PARTIAL_ANNOUNCE_SEC
+// while new pieces are verified, so leechers arriving mid-download find them. Leechers already
+// connected learn them from get_bitfield, and the peer server serves exactly those
+bool Client::register_partial_seeder(DownloadJob &job) {
+    Bitfield bits;
+    if (!local_pieces().bitfield(job.shared_path, bits)) return false;
+    if (job.partial_seeder && bits == job.announced_pieces) return true;
+    string command = "update_pieces " + job.finfo.group + " " + job.finfo.name + " " + job.shared_path + " " + bitfield_to_hex(bits) + "\n";
+    if (command.size() > MAX_PIECES_ANNOUNCE_LINE) return false;
+
+    lock_guard<mutex> lk(tracker_comm_mutex);
+    drain_socket(tracker_sock);
+    send(tracker_sock, command.c_str(), command.size(), MSG_NOSIGNAL);
+    char buffer[1024];
+    int n = recv(tracker_sock, buffer, sizeof(buffer) - 1, 0);
+    if (n <= 0) return false;
+    buffer[n] = '\0';
+    // a user already sharing the whole file gets another reply, it must never be withdrawn as partial
+    if (string(buffer).find("are successfully updated") == string::npos) return false;
+    job.announced_pieces = move(bits);
     return true;
 }
 
-// ---------- Client side: write piece to file ----------
-bool Client::write_content(const string path, int index, const string &data,uint64_t global_piece_size, shared_ptr<mutex> file_mutex) {
-    lock_guard<mutex> lock(*file_mutex);
-    int fd = open64(path.c_str(), O_WRONLY);
-    if (fd < 0) { 
-        perror("open64"); 
-        return false; 
-    }
-    off64_t offset = (off64_t)index * (off64_t)global_piece_size;
-    if (lseek64(fd, offset, SEEK_SET) == (off64_t)-1) { 
-        perror("lseek64"); 
-        close(fd); 
-        return false; 
-    }
-
-    const char *buf = data.data();
-    uint64_t left = data.size(), written = 0;
-    while (written < left) {
-        ssize_t w = write(fd, buf + written, left - written);
-        if (w < 0) { 
-            perror("write"); 
-            close(fd); 
-            return false; 
-        }
-        written += (uint64_t)w;
-    }
-    close(fd);
-    return true;
+// a download that fails stops being offered, its file is about to be deleted; `partial` makes the
+// tracker keep a complete copy this user shares under the same name
+void Client::withdraw_partial_seeder(DownloadJob &job) {
+    local_pieces().untrack(job.shared_path);
+    fd_cache().invalidate(job.shared_path);
+    if (!job.partial_seeder) return;
+    string command = "stop_share " + job.finfo.group + " " + job.finfo.name + " partial\n";
+    lock_guard<mutex> lk(tracker_comm_mutex);
+    drain_socket(tracker_sock);
+    send(tracker_sock, command.c_str(), command.size(), MSG_NOSIGNAL);
+    char buffer[1024];
+    recv(tracker_sock, buffer, sizeof(buffer) - 1, 0);
+    job.partial_seeder = false;
 }
 
-// ---------- Client side: download one piece ----------
-bool Client::download_piece(const string piece_sha, shared_ptr<map<string, Address>> seeders,int piece_index, shared_ptr<map<string,string>> file_paths,const string dest, uint64_t piece_size, uint64_t total_size,shared_ptr<mutex> file_mutex) {
-    if (seeders->empty()) return false;
+// ---------- Client side: download loop of one seeder ----------
+// keeps up to `depth` get_piece requests in flight on a single connection, so the link never
+// idles for a round trip between pieces. depth is fixed by P2P_PIPELINE_DEPTH or follows the
+// measured bandwidth-delay product of this seeder.
+void Client::download_from_seeder(shared_ptr<DownloadJob> job, const string &seeder) {
+    using clock = chrono::steady_clock;
+    struct Outstanding {
+        int piece_index;
+        int block;                  // WHOLE_PIECE, or the block of a split piece
+        clock::time_point sent_at;
+        bool idle_link;             // request went out while nothing else was in flight
+        bool cancelled = false;
+        PieceBuffer data;           // filled while the piece arrives, or the bytes of a partial piece
+        PieceProgress progress;
+    };
+    // a piece cut off by a broken connection keeps its bytes for the next seeder that gets it
+    auto keep_partial = [&job](Outstanding &o) {
+        if (o.progress.received == 0 || o.data.data() == nullptr) return;
+        lock_guard<mutex> lock(job->partial_mutex);
+        job->partial_pieces[o.piece_index] = PartialPiece{move(o.data), o.progress};
+    };
+    auto take_partial = [&job](Outstanding &o) {
+        lock_guard<mutex> lock(job->partial_mutex);
+        auto it = job->partial_pieces.find(o.piece_index);
+        if (it == job->partial_pieces.end()) return;
+        o.data = move(it->second.data);
+        o.progress = it->second.progress;
+        job->partial_pieces.erase(it);
+    };
+
+    PieceScheduler &scheduler = *job->scheduler;
+    const Address &address = job->finfo.seeder_users.at(seeder);
+    // every seeder loop reads the shared FileInfo at once, lookups must not insert; a seeder without
+    // a path throws and is given up like one that can not be reached
+    const string &remote_path = job->finfo.user_file_map.at(seeder);
+
+    int sock = connect_with_timeout(address.ip, address.port, 10);
+    if (sock < 0) {
+        scheduler.seeder_gone(seeder, {});
+        return;
+    }
+    PeerSession session(seeder, sock);
+    if (!job->add_session(sock)) return;
+    // declared after the session, so the socket is unregistered before the session closes it
+    struct SessionRegistration {
+        DownloadJob &job;
+        int sock;
+        ~SessionRegistration() { job.remove_session(sock); }
+    } registration{*job, sock};
+
+    // the seeder announces which pieces it holds before any is requested from it
+    Bitfield bits;
+    PieceResult announced = session.request_bitfield(remote_path, job->finfo.piece_size) ?
+                            session.receive_bitfield(job->finfo.piece_SHA.size(), bits) : PieceResult::BROKEN;
+    if (announced != PieceResult::RECEIVED) {
+        scheduler.seeder_gone(seeder, {});
+        return;
+    }
+    scheduler.set_seeder_pieces(seeder, bits);
+
+    PipelineTuner tuner;
+    const int configured_depth = client_config().pipeline_depth;
+    deque<Outstanding> in_flight;
+    bool broken = false;
+
+    // a request that throws breaks the loop like a broken connection, so the ones still in flight
+    // are handed back to the scheduler
+    try {
+        while (!broken) {
+            PieceRequest request;
+            while ((int)in_flight.size() < tuner.depth(scheduler.request_size(), configured_depth) &&
+                   scheduler.next_request(seeder, request, in_flight.empty())) {
+                int piece_index = request.piece;
+                Outstanding o;
+                o.piece_index = piece_index;
+                o.block = request.block;
+                o.sent_at = clock::now();
+                o.idle_link = in_flight.empty();
+                bool sent;
+                if (o.block != WHOLE_PIECE) {
+                    sent = session.request_block(remote_path, piece_index, (uint64_t)o.block * SPLIT_BLOCK_SIZE,
+                                                 job->request_length(piece_index, o.block), job->finfo.piece_size);
+                } else {
+                    take_partial(o);
+                    // a partial piece is completed with get_block, only its missing tail crosses the network
+                    uint64_t have = o.progress.received;
+                    sent = have > 0 ? session.request_block(remote_path, piece_index, have, job->piece_length(piece_index) - have, job->finfo.piece_size)
+                                    : session.request_piece(remote_path, piece_index, job->finfo.piece_size);
+                }
+                in_flight.push_back(move(o));
+                if (!sent) {
+                    broken = true;
+                    break;
+                }
+            }
+            if (broken) break;
+            if (in_flight.empty()) {
+                if (scheduler.done()) break;
+                // idle: the seeder may have verified pieces since it announced them
+                Bitfield refreshed;
+                PieceResult result = session.request_bitfield(remote_path, job->finfo.piece_size) ?
+                                     session.receive_bitfield(job->finfo.piece_SHA.size(), refreshed) : PieceResult::BROKEN;
+                if (result != PieceResult::RECEIVED) {
+                    broken = true;
+                    break;
+                }
+                scheduler.set_seeder_pieces(seeder, refreshed);
+                continue;
+            }
 
-    int total_pieces = (total_size + piece_size - 1)/piece_size;
-    uint64_t expected_size = (piece_index == total_pieces-1)? total_size - (uint64_t)piece_index*piece_size : piece_size;
+            // endgame: cancel duplicates another seeder delivered first, this one may not have started them
+            if (scheduler.endgame()) {
+                for (Outstanding &o : in_flight) {
+                    if (o.cancelled || !scheduler.finished(o.piece_index)) continue;
+                    o.cancelled = true;
+                    session.cancel_piece(remote_path, o.piece_index);
+                }
+            }
 
-    vector<string> keys;
-    keys.reserve(seeders->size());
-    for (const auto &p : *seeders) keys.push_back(p.first);
+            Outstanding &front = in_flight.front();
+            char* in_place = nullptr;
+            clock::time_point header_at;
+            uint64_t length = job->request_length(front.piece_index, front.block);
+            uint64_t offset = (uint64_t)front.piece_index * job->finfo.piece_size;
+            uint64_t resumed_at = front.progress.received;
+            PieceResult result = session.receive_piece_header(front.piece_index, length - resumed_at, &header_at);
+            if (result == PieceResult::RECEIVED) {
+                // a piece only this seeder is fetching goes straight into the mapped destination
+                if (front.block == WHOLE_PIECE && resumed_at == 0 && job->dest_map && scheduler.claim_in_place(front.piece_index, seeder)) {
+                    in_place = job->dest_map->at(offset);
+                } else if (resumed_at == 0) {
+                    front.data = piece_buffers().acquire(length);
+                }
+                // a block is hashed with the rest of its piece once the piece is whole
+                if (!session.receive_piece_data(in_place ? in_place : front.data.data(), length, front.progress, front.block == WHOLE_PIECE)) {
+                    result = PieceResult::BROKEN;
+                }
+            }
+            if (result == PieceResult::BROKEN) {
+                broken = true;
+                break;
+            }
+            Outstanding next = move(front);
+            in_flight.pop_front();
+            // this seeder lacks the piece after all, the bytes so far are still good for another one
+            if (result == PieceResult::REJECTED) keep_partial(next);
+
+            if (result == PieceResult::RECEIVED) {
+                clock::time_point done_at = clock::now();
+                if (next.idle_link) tuner.on_rtt_sample(chrono::duration<double>(header_at - next.sent_at).count());
+                tuner.on_transfer_sample(length - resumed_at, chrono::duration<double>(done_at - header_at).count());
+                scheduler.report_speed(seeder, tuner.bandwidth() / scheduler.request_size(), tuner.rtt());
+            }
 
-    int num_seeders = keys.size();
-    int start_index = piece_index % num_seeders; // deterministic sprea
+            // only the first copy of a block is kept
+            if (next.block != WHOLE_PIECE) {
+                if (result == PieceResult::REJECTED) {
+                    scheduler.block_failed(next.piece_index, next.block, seeder);
+                } else if (result == PieceResult::CANCELLED || !scheduler.claim_block(next.piece_index, next.block)) {
+                    scheduler.block_abandoned(next.piece_index, next.block, seeder);
+                } else {
+                    deliver_block(job, next.piece_index, next.block, seeder, next.data);
+                }
+                continue;
+            }
 
-    // Try all seeders until one succeeds
-    for (int i = 0; i < num_seeders; ++i) {
-        const string &seeder = keys[(start_index + i) % num_seeders];
-        Address address = (*seeders)[seeder];
-        int sock = connect_with_timeout(address.ip, address.port, 10);
-        if (sock < 0) {
-            continue;
-        }
-        string req = "get_piece " + (*file_paths)[seeder] + " " + to_string(piece_index) + "\n";
-        if (send(sock, req.c_str(), req.size(), MSG_NOSIGNAL) <= 0) { 
-            close(sock); 
-            continue; 
-        }
+            // a bad copy received in place stays on disk with its bit clear until a retry overwrites it
+            if (in_place) {
+                bool verified = next.progress.finish() == job->finfo.piece_SHA[next.piece_index];
+                if (verified) job->dest_map->flush(offset, length);
+                complete_piece(*job, next.piece_index, seeder, verified);
+                continue;
+            }
 
-        string piece;
-        if (!receive_piece(sock, piece, expected_size)) { 
-            close(sock); 
-            continue; 
+            // a copy another seeder already delivered is dropped
+            if (result == PieceResult::CANCELLED || scheduler.finished(next.piece_index)) {
+                scheduler.piece_abandoned(next.piece_index, seeder);
+                continue;
+            }
+            bool verified = result == PieceResult::RECEIVED && next.progress.finish() == job->finfo.piece_SHA[next.piece_index];
+            if (!verified) {
+                complete_piece(*job, next.piece_index, seeder, false);
+                continue;
+            }
+            // endgame duplicates can verify at the same time, only the first one is written
+            if (!scheduler.claim(next.piece_index, seeder)) {
+                scheduler.piece_abandoned(next.piece_index, seeder);
+                continue;
+            }
+            // the piece stays in flight for the scheduler until the write is done
+            int written_index = next.piece_index;
+            piece_writer().write(job->dest_fd, job->dest_slot, offset, move(next.data),
+                                 [this, job, written_index, seeder](bool written) {
+                                     complete_piece(*job, written_index, seeder, written);
+                                 });
         }
-        close(sock);
+    } catch (const std::exception &ex) {
+        cerr << "Exception in download loop of seeder " << seeder << ": " << ex.what() << endl;
+        broken = true;
+    } catch (...) {
+        cerr << "Unknown exception in download loop of seeder " << seeder << endl;
+        broken = true;
+    }
 
-        if (calculate_SHA(piece) != piece_sha) 
-        {
-            continue;
+    if (broken) {
+        // a block cut off is fetched again whole, a cut off piece keeps its bytes
+        vector<PieceRequest> unfinished;
+        for (Outstanding &o : in_flight) {
+            if (o.block == WHOLE_PIECE) keep_partial(o);
+            unfinished.push_back(PieceRequest{o.piece_index, o.block});
         }
-        return write_content(dest, piece_index, piece, piece_size, file_mutex);
+        scheduler.seeder_gone(seeder, unfinished);
     }
-    return false;
 }
 
-// assign download task to thread pool
-void Client::assign_download_task(const string piece_sha,shared_ptr<map<string, Address>> seeder_ptr,int piece_index,shared_ptr<map<string, string>> file_path_map_ptr,const string destination_file_name,uint64_t piece_size,uint64_t total_size,shared_ptr<unordered_map<int,bool>> download_results,shared_ptr<mutex> file_mutex, shared_ptr<DownloadTask> download_task,shared_ptr<mutex> results_mutex)
+// start one seeder's download loop on a thread of its own. The loop blocks on its connection for
+// the whole download, on the executor it would hold a worker that long: a download with as many
+// seeders as workers would stall every other download and the executor's short tasks
+future<void> Client::assign_seeder_task(shared_ptr<DownloadJob> job, const string &seeder)
 {
-    unique_lock<mutex> lock(thread_mutex);
-    thread_cv.wait(lock, [] { 
-        return is_any_thread_available(); 
-    });
-    int idx = get_available_thread();
-    lock.unlock();
-
-    string dest_copy = destination_file_name;
-    string sha_copy = piece_sha;
-
-    thread_pool[idx] = thread([this, idx, sha_copy, seeder_ptr, piece_index, file_path_map_ptr,dest_copy, piece_size, total_size, download_results,file_mutex, download_task, results_mutex]() {
-        bool success = false;
+    return async(launch::async, [this, job, seeder]() {
+        // the request loop hands its own requests back when it throws, what gets here failed before
+        // anything was requested
         try {
-            success = download_piece(sha_copy, seeder_ptr, piece_index, file_path_map_ptr, dest_copy, piece_size, total_size, file_mutex);
+            download_from_seeder(job, seeder);
         } catch (const std::exception &ex) {
-            cerr << "Exception in download thread " << piece_index << ": " << ex.what() << endl;
-            success = false;
-        } catch (...) {
-            cerr << "Unknown exception in download thread " << piece_index << endl;
-            success = false;
-        }
-
-        try {
-            lock_guard<mutex> guard(*results_mutex);
-            (*download_results)[piece_index] = success;
-            if (success) {
-                lock_guard<mutex> task_guard(download_task->m);
-                download_task->completed_pieces++;
-            }
+            cerr << "Exception in download thread of seeder " << seeder << ": " << ex.what() << endl;
+            job->scheduler->seeder_gone(seeder, {});
         } catch (...) {
-            cerr << "Error updating download results for piece " << piece_index << endl;
+            cerr << "Unknown exception in download thread of seeder " << seeder << endl;
+            job->scheduler->seeder_gone(seeder, {});
         }
-
-        release_thread(idx);
     });
-
-    thread_pool[idx].detach();
 }
 
 // receive full message from socket, first read length then read full data
@@ -589,24 +649,18 @@ string Client::receive_full_file_data(int sock) {
     
     uint64_t msg_len = ntohll(len_net);
     
-    // Add safety check for message length
-    if (msg_len == 0 || msg_len > 1024*1024) { // Max 1MB
+    // same bound the tracker puts on an upload, a few million pieces fit
+    if (msg_len == 0 || msg_len > MAX_METADATA_SIZE) {
         cerr << "Invalid message length: " << msg_len << endl;
         return "";
     }
 
-    string ACK = "ACK\n";
-    if (send(sock, ACK.c_str(), ACK.size(), MSG_NOSIGNAL) <= 0) {
-        cerr << "Failed to send ACK" << endl;
-        return "";
-    }
-
     string result;
     result.reserve(msg_len); // Reserve instead of resize
     result.resize(msg_len);
     
     uint64_t total = 0;
-    const size_t CHUNK_SIZE = 8192; // Read in smaller chunks
+    const size_t CHUNK_SIZE = 256 * 1024;
     
     while (total < msg_len) {
         size_t to_read = min(CHUNK_SIZE, (size_t)(msg_len - total));
@@ -635,6 +689,31 @@ string Client::receive_full_file_data(int sock) {
 //     return string(buf.begin(), buf.end());
 // }
 
+// one chunk of a streamed piece hash list, it must continue at `expected_first`;
+// the digests are copied straight into their slots of `piece_SHA`
+bool Client::receive_hash_chunk(int sock, vector<Digest>& piece_SHA, size_t expected_first, size_t& count) {
+    string frame = receive_full_file_data(sock);
+    size_t first;
+    const unsigned char* digests;
+    if (!parse_piece_chunk(frame, first, count, digests) || first != expected_first ||
+        count == 0 || count > piece_SHA.size() - first) {
+        cerr << "Invalid piece hash chunk from tracker" << endl;
+        return false;
+    }
+    memcpy(piece_SHA.data() + first, digests, count * DIGEST_SIZE);
+    return true;
+}
+
+// a piece hash stream that can not be followed any more (undecodable reply, broken chunk): whatever
+// the tracker still sends of it is read and dropped until the socket stays quiet
+static void discard_tracker_stream(int sock) {
+    char tmp[4096];
+    struct pollfd pfd{sock, POLLIN, 0};
+    while (poll(&pfd, 1, TRACKER_STREAM_QUIET_MS) > 0) {
+        if (recv(sock, tmp, sizeof(tmp), 0) <= 0) break;
+    }
+}
+
 // drain_socket: read and discard all data from socket
 void drain_socket(int sock) {
     char tmp[4096];
@@ -652,7 +731,7 @@ void drain_socket(int sock) {
 }
 
 // main function to download file, it first get file info from tracker then assign task to thread pool to download piece of file
-string Client::file_download_command(string command, shared_ptr<DownloadTask> download_task, shared_ptr<mutex> results_mutex) {
+string Client::file_download_command(string command, shared_ptr<DownloadTask> download_task) {
                              //-----------------first get file info from tracker-----------------//
 
     //remove destination_path from command before sending to tracker
@@ -660,31 +739,51 @@ string Client::file_download_command(string command, shared_ptr<DownloadTask> do
     if (last_space == string::npos) {
         return "Invalid command format. Usage: download_file <group id> <file path> <destination>\n";
     }
-    string command_to_send = command.substr(0, last_space);
-    std::lock_guard<std::mutex> lk(tracker_comm_mutex);
+    // ask for the streamed reply: the piece digests come in chunks and pieces are fetched as they arrive
+    string command_to_send = command.substr(0, last_space) + " stream\n";
+    unique_lock<mutex> tracker_lock(tracker_comm_mutex);
     drain_socket(tracker_sock);
     send(tracker_sock, command_to_send.c_str(), command_to_send.size(), MSG_NOSIGNAL);
 
 
     string file_info_command = receive_full_file_data(tracker_sock);
-    trim_whitespace(file_info_command);
     if(file_info_command.empty()) {
         return "File data is empty. Please try again.\n";
     }
-    // cout<<"Received response from tracker: "<<file_info_command<<endl;
 
-    if(file_info_command.find("file_data") == string::npos) {
+    // "file_data " + binary FileInfo, or "file_data_stream " + FileInfo whose piece digests follow in
+    // chunks; anything else is a text error from the tracker
+    const string file_data_prefix = "file_data ";
+    const string stream_prefix = "file_data_stream ";
+    bool streamed = file_info_command.compare(0, stream_prefix.size(), stream_prefix) == 0;
+    const string& prefix = streamed ? stream_prefix : file_data_prefix;
+    if(file_info_command.compare(0, prefix.size(), prefix) != 0) {
+        trim_whitespace(file_info_command);
         return file_info_command+"\n"; 
     }
-    string file_info = file_info_command.substr(file_info_command.find(' ') + 1);
-    trim_whitespace(file_info);
+    auto job = make_shared<DownloadJob>();
+    FileInfo &finfo = job->finfo;
+    if(!FileInfo::decode(string_view(file_info_command).substr(prefix.size()), finfo) || !valid_piece_size(finfo.piece_size)) {
+        // how many digest chunks follow is unknown without a usable FileInfo
+        if (streamed) discard_tracker_stream(tracker_sock);
+        return "Invalid file data received from tracker.\n";
+    }
+    file_info_command.clear();
 
-    if(file_info.empty()) {
-        return "File data is empty. Please try again.\n";
+    size_t total_pieces = (finfo.size + finfo.piece_size - 1) / finfo.piece_size;
+    if(!streamed && finfo.piece_SHA.size() != total_pieces) {
+        return "Invalid file data received from tracker.\n";
     }
-    // cout<<"Received file info from tracker. Preparing to download..."<<endl;
-    // cout<<"Debug: File Info: "<<file_info.size()<<endl;
-    FileInfo finfo = FileInfo::fromString(file_info);
+    // digests are filled in place as chunks arrive, the vector is never resized while pieces download
+    size_t known_pieces = streamed ? 0 : total_pieces;
+    finfo.piece_SHA.resize(total_pieces);
+    // a download given up before the stream ended still has to take the rest off the tracker socket
+    auto skip_hash_chunks = [&]() {
+        size_t count;
+        while (known_pieces < total_pieces && receive_hash_chunk(tracker_sock, finfo.piece_SHA, known_pieces, count)) {
+            known_pieces += count;
+        }
+    };
     
     for(auto &[user, addr] : finfo.seeder_users) {
         cout << "\nSeeder: " << user << " at " << addr.ip << ":" << addr.port;
@@ -713,6 +812,7 @@ string Client::file_download_command(string command, shared_ptr<DownloadTask> do
     
     trim_whitespace(destination_file_name);
     if(!create_file(destination_file_name, finfo.size)) {
+        skip_hash_chunks();
         return "Failed to create destination file: " + destination_file_name + "\n";
     }
     // cout<<"Destination file ready: " << destination_file_name << endl;
@@ -721,54 +821,132 @@ string Client::file_download_command(string command, shared_ptr<DownloadTask> do
     //------------------------------ assign task to thread download piece of file------------------------------//
 
     
-    vector<int>  piece_order(finfo.piece_SHA.size());
-    iota(piece_order.begin(), piece_order.end(), 0);
     random_device rd;
     mt19937 g(rd());
-    shuffle(piece_order.begin(), piece_order.end(), g);
-    auto download_results_ptr = make_shared<unordered_map<int,bool>>();
-    auto file_mutex_ptr = make_shared<mutex>();
-    auto seeder_ptr = make_shared<map<string, Address>>(finfo.seeder_users);
-    auto file_path_map_ptr = make_shared<map<string, string>>(finfo.user_file_map);
+
+    vector<string> seeder_names;
+    for (auto &[user, addr] : finfo.seeder_users) seeder_names.push_back(user);
+
+    job->destination = destination_file_name;
+    char shared_path[PATH_MAX];
+    job->shared_path = realpath(destination_file_name.c_str(), shared_path) != nullptr ? string(shared_path) : destination_file_name;
+    // create_file may have resized an existing file, so never reuse a descriptor cached before it
+    fd_cache().invalidate(destination_file_name);
+    job->dest_file = fd_cache().acquire(destination_file_name, true);
+    if (!job->dest_file) {
+        skip_hash_chunks();
+        return "Failed to open destination file: " + destination_file_name + "\n";
+    }
+    job->dest_fd = job->dest_file->fd;
+    // a file being downloaded announces only its verified pieces
+    local_pieces().track(job->shared_path, total_pieces);
+    job->dest_slot = piece_writer().register_file(job->dest_fd);
+    if (client_config().mmap_writes) {
+        job->dest_map = make_unique<MappedFile>();
+        if (!job->dest_map->map(job->dest_fd, finfo.size)) job->dest_map.reset();
+    }
+    // progress bitfield; a journal left by an interrupted download of the same file lists the pieces to keep
+    job->journal = make_shared<PieceJournal>();
+    if (!job->journal->open(destination_file_name, finfo.full_SHA, finfo.size, finfo.piece_size, total_pieces)) {
+        // only this download fails, the destination keeps whatever an earlier attempt wrote
+        skip_hash_chunks();
+        local_pieces().untrack(job->shared_path);
+        piece_writer().unregister_file(job->dest_slot);
+        job->dest_map.reset();
+        job->dest_file.reset();
+        fd_cache().invalidate(destination_file_name);
+        return "Failed to track the progress of " + destination_file_name + "\n";
+    }
+    if (!job->journal->resumable()) cerr << "Piece journal unavailable, this download can not be resumed\n";
+    job->scheduler = make_shared<PieceScheduler>(total_pieces, finfo.piece_size, finfo.size, seeder_names, finfo.seeder_pieces);
 
     {
         lock_guard<mutex> task_guard(download_task->m);
-        download_task->total_pieces = finfo.piece_SHA.size();
-        download_task->completed_pieces = 0;
+        download_task->pieces = job->journal;
         download_task->done = false;
         download_task->result = "[R] "+finfo.group + " " +finfo.name;
     }
 
-
-
-    for (size_t i = 0; i < piece_order.size(); i++) {
-        string piece_sha = finfo.piece_SHA[piece_order[i]];
-        // add sleep of 0.05 sec
-        if (i % 100 == 0) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    // pieces whose digest is known go to the scheduler in random order, a chunk at a time;
+    // journaled pieces are only set aside here, reading them back waits until the stream is done
+    vector<int> journaled;
+    auto add_pieces = [&](size_t first, size_t count) {
+        vector<int> piece_order;
+        for (size_t piece_index = first; piece_index < first + count; ++piece_index) {
+            if (job->journal->has(piece_index)) journaled.push_back((int)piece_index);
+            else piece_order.push_back((int)piece_index);
         }
-        assign_download_task(piece_sha, seeder_ptr, piece_order[i], file_path_map_ptr, destination_file_name, finfo.piece_size, finfo.size, download_results_ptr, file_mutex_ptr, download_task, results_mutex);
-
+        shuffle(piece_order.begin(), piece_order.end(), g);
+        // without any usable seeder a piece is given up right away
+        job->scheduler->add_pieces(piece_order);
+    };
+    add_pieces(0, known_pieces);
+
+    // one pipelined connection per seeder, pieces are pulled from the shared scheduler
+    vector<future<void>> seeder_loops;
+    for (const string &seeder : seeder_names) {
+        seeder_loops.push_back(assign_seeder_task(job, seeder));
     }
 
-    join_all_threads();
-    drain_socket(tracker_sock);
-
-    {
-        lock_guard<mutex> guard(*results_mutex);
-        for (auto &[piece_index, success] : *download_results_ptr) {
-            if (!success) {
-                download_task->result="[F] "+finfo.group + " " +finfo.name;
-                download_task->done = true;
-                 if (remove(destination_file_name.c_str()) != 0) {
-                    perror("Error deleting file");
-                } else {
-                    cout<<download_task->result + "\n";
-                }
-                // cout<<"Download failed: piece " << piece_index << " corrupted or missing\n";
-                return "Download failed: piece " + to_string(piece_index) + " corrupted or missing\n";
-            }
+    // the seeders are already busy with the first chunks while the rest of the digests arrive
+    while (known_pieces < total_pieces) {
+        size_t count;
+        if (!receive_hash_chunk(tracker_sock, finfo.piece_SHA, known_pieces, count)) {
+            cerr << "Piece hash stream from tracker broke off at piece " << known_pieces << endl;
+            job->scheduler->abandon_pieces(total_pieces - known_pieces);
+            discard_tracker_stream(tracker_sock);
+            break;
+        }
+        add_pieces(known_pieces, count);
+        known_pieces += count;
+    }
+    // the tracker socket is free again for commands
+    tracker_lock.unlock();
+
+    // journaled pieces that still match their digest are kept, the others are fetched again
+    vector<int> on_disk, refetch;
+    for (int piece_index : journaled) {
+        if (piece_on_disk(*job, piece_index)) {
+            local_pieces().mark(job->shared_path, piece_index);
+            on_disk.push_back(piece_index);
+        } else {
+            job->journal->clear(piece_index);
+            refetch.push_back(piece_index);
+        }
+    }
+    job->scheduler->settle_pieces(on_disk);
+    shuffle(refetch.begin(), refetch.end(), g);
+    job->scheduler->add_pieces(refetch);
+    if (!on_disk.empty()) cout << "\nResuming " << finfo.name << ": " << on_disk.size() << " of " << total_pieces << " pieces already on disk\n>";
+    // offer the pieces we have to the rest of the swarm
+    job->partial_seeder = register_partial_seeder(*job);
+    while (!job->scheduler->wait_until_finished(chrono::seconds(PARTIAL_ANNOUNCE_SEC))) {
+        // the reply shares the tracker socket, register_partial_seeder waits for tracker_comm_mutex
+        if (job->partial_seeder) register_partial_seeder(*job);
+    }
+    // a seeder may still be sending a duplicate of a settled piece, it is not waited for
+    job->close_sessions();
+    for (future<void> &loop : seeder_loops) loop.wait();
+    // every piece is settled, so no write is left in flight on the destination
+    piece_writer().unregister_file(job->dest_slot);
+    job->dest_map.reset();
+    job->dest_file.reset();
+
+    size_t missing_piece = job->journal->first_missing();
+    if (missing_piece < total_pieces) {
+        withdraw_partial_seeder(*job);
+        fd_cache().invalidate(destination_file_name);
+        lock_guard<mutex> tguard(download_task->m);
+        download_task->result="[F] "+finfo.group + " " +finfo.name;
+        download_task->done = true;
+        // the verified pieces stay on disk with their journal, download_file again resumes
+        if (!job->journal->resumable() && remove(destination_file_name.c_str()) != 0) {
+            perror("Error deleting file");
+        } else {
+            cout<<download_task->result + "\n";
         }
+        // cout<<"Download failed: piece " << piece_index << " corrupted or missing\n";
+        return "Download failed: piece " + to_string(missing_piece) + " corrupted or missing\n";
     }
 
     char full_path[PATH_MAX];
@@ -777,9 +955,9 @@ string Client::file_download_command(string command, shared_ptr<DownloadTask> do
         saved_full_path = string(full_path);
     }
 
-    string full_file_sha = calculate_full_file_SHA(saved_full_path);
-    // cout<<"Expected Full File SHA: " << finfo.full_SHA << endl;
-    // cout<<"Calculated Full File SHA: " << full_file_sha << endl;
+    // every piece landed and matched its piece_SHA, so the file is right once the piece list is:
+    // rebuilding the Merkle root from it replaces re-reading the whole file
+    bool full_file_verified = calculate_merkle_root(finfo.piece_SHA) == finfo.full_SHA;
 
     // cout<<"Expected Size: " << finfo.size << endl;
     // struct stat file_stat;
@@ -787,11 +965,12 @@ string Client::file_download_command(string command, shared_ptr<DownloadTask> do
         // cout<<"Downloaded File Size: " << file_stat.st_size << endl;
     // }
 
-    drain_socket(tracker_sock);
-    
-    if(full_file_sha != finfo.full_SHA) {
+    if(!full_file_verified) {
         // string piece_sha = read_piece_from_file(destination_file_name, 0, finfo.piece_size, finfo.size);
         // cout<<"First piece data (first 100 bytes or less): " << (piece_sha==finfo.piece_SHA[0]) << endl;
+        withdraw_partial_seeder(*job);
+        // the piece list itself is wrong, nothing of this attempt is worth resuming
+        job->journal->remove();
         lock_guard<mutex> tguard(download_task->m);
         download_task->result="[F] "+finfo.group + " " +finfo.name;
         download_task->done = true;
@@ -804,25 +983,24 @@ string Client::file_download_command(string command, shared_ptr<DownloadTask> do
         return "[F]"+finfo.group + " " +finfo.name + "\n";
     }
 
-    string command_to_update_fileinfo="update_file_info "+ finfo.group + " " + finfo.name + " " + saved_full_path ;
-    // std::lock_guard<std::mutex> lk(tracker_comm_mutex);
-    drain_socket(tracker_sock);
-    send(tracker_sock, command_to_update_fileinfo.c_str(), command_to_update_fileinfo.size(), 0);
+    // the whole file is verified, from here on it is served like any complete file
+    local_pieces().untrack(job->shared_path);
+    job->journal->remove();
+    string command_to_update_fileinfo="update_file_info "+ finfo.group + " " + finfo.name + " " + saved_full_path + "\n";
+    string response;
+    {
+        lock_guard<mutex> lk(tracker_comm_mutex);
+        drain_socket(tracker_sock);
+        send(tracker_sock, command_to_update_fileinfo.c_str(), command_to_update_fileinfo.size(), MSG_NOSIGNAL);
 
-    int n;
-    char buffer[2048];
-    memset(buffer, 0, sizeof(buffer));
-    while (true) {
-        n = recv(tracker_sock, buffer, sizeof(buffer) - 1, MSG_DONTWAIT);  
-        if (n <= 0) {
-            break;
-        }
-        buffer[n] = '\0'; 
+        char buffer[2048];
+        int n = recv(tracker_sock, buffer, sizeof(buffer) - 1, 0);
+        if (n > 0) response.assign(buffer, n);
     }
-    string response(buffer);
 
     if (response.find("Failed") != string::npos) {
         // delete created_file
+        withdraw_partial_seeder(*job);
         lock_guard<mutex> tguard(download_task->m);
         download_task->result="[F] "+finfo.group + " " +finfo.name;
         cout<<download_task->result + "\n";
@@ -839,7 +1017,6 @@ string Client::file_download_command(string command, shared_ptr<DownloadTask> do
         string success_msg = "[C] " + finfo.group + " " + finfo.name + "\n>";
         cout<<success_msg;
     }
-    drain_socket(tracker_sock);
     return response;
     
 }
@@ -850,8 +1027,10 @@ string Client::file_download_command(string command, shared_ptr<DownloadTask> do
 // this funtion if login ,creae_user and logout maintain status in clicnt side,if succes come then update status
 string Client::handle_command(string command) {
 
+    // download_file and show_downloads never touch the tracker socket, every other command waits
+    // for tracker_comm_mutex: a download may be reading its piece hash stream from the same socket
+
     //upload_file <group id> <file path>
-    drain_socket(tracker_sock);
     if(command.find("upload_file") == 0){
 
         if(!logged_in){
@@ -873,6 +1052,8 @@ string Client::handle_command(string command) {
             return "File does not exist. Please check the file path.\n";
         }
 
+        lock_guard<mutex> lk(tracker_comm_mutex);
+        drain_socket(tracker_sock);
         return file_upload_command(command);
 
     }
@@ -894,9 +1075,11 @@ string Client::handle_command(string command) {
         lock_guard<mutex> lg(download_history_mutex);
         download_history.push_back(task);
 
-        auto results_mutex = make_shared<mutex>();
-        thread([this, command, task, results_mutex]() {
-            string res = file_download_command(command, task, results_mutex);
+        // not an executor task: file_download_command waits for its seeder loops until the whole
+        // file is in, it would hold a worker that long and starve the executor's short tasks.
+        // One thread per download_file command, never per piece
+        thread([this, command, task]() {
+            string res = file_download_command(command, task);
             cout << res << endl;
         }).detach();
 
@@ -918,12 +1101,18 @@ string Client::handle_command(string command) {
         for (auto &t : history_copy) {
             lock_guard<mutex> tg(t->m);
             if (t->done) out += t->result + "\n";
-            else out += "Download Status: " + to_string(t->completed_pieces) + "/" + to_string(t->total_pieces) + " pieces completed.\n" + t->result + "\n";
+            else {
+                // the bits are read straight from the download's mapped journal
+                size_t completed = t->pieces ? t->pieces->count() : 0;
+                size_t total = t->pieces ? t->pieces->total() : 0;
+                out += "Download Status: " + to_string(completed) + "/" + to_string(total) + " pieces completed.\n" + t->result + "\n";
+            }
         }
         if (out.empty()) return "No download history available.\n";
         return out;
     }
 
+    lock_guard<mutex> lk(tracker_comm_mutex);
     drain_socket(tracker_sock);
     send(tracker_sock, command.c_str(), command.size(), MSG_NOSIGNAL);
     char buffer[1024];
@@ -972,6 +1161,17 @@ string Client::handle_command(string command) {
         }
     }
 
+    else if (command.find("stop_share") == 0) {
+        // the tracker only knows the file name, drop every cached descriptor of a file with that name
+        if (response.find("successfully stopped sharing") != string::npos) {
+            vector<string> tokens;
+            tokenize(command, tokens);
+            if (tokens.size() == 3) {
+                fd_cache().invalidate_name(tokens[2].substr(tokens[2].find_last_of("/\\") + 1));
+            }
+        }
+    }
+
     return response;
 }
 
@@ -989,6 +1189,7 @@ void Client::start_client_command_loop() {
         string msg=command + "\n";
 
         if (command == "exit") {
+            lock_guard<mutex> lk(tracker_comm_mutex);
             send(tracker_sock, msg.c_str(), msg.size(), MSG_NOSIGNAL);
             cout << "Exiting client command loop.\n";
             break;
@@ -1023,7 +1224,8 @@ bool Client::stop()
 {
     // Implement any necessary cleanup here
     close(tracker_sock);
-    clear_thread_pool();
+    if (peer_server) peer_server->stop();
+    executor().shutdown();
     cout << "Client stopped.\n";
     return true;
 }
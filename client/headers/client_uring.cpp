@@ -0,0 +1,199 @@
+#include "./uring_header.h"
+
+#ifdef P2P_WITH_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+static int io_uring_setup(unsigned entries, struct io_uring_params* params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, const void* arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static unsigned* ring_field(void* ring, unsigned offset) {
+    return (unsigned*)((char*)ring + offset);
+}
+
+IoUring::~IoUring() {
+    if (sqes != nullptr) munmap(sqes, sqes_size);
+    if (cq_ring != nullptr && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+    if (sq_ring != nullptr) munmap(sq_ring, sq_ring_size);
+    if (ring_fd >= 0) close(ring_fd);
+}
+
+bool IoUring::init(unsigned queue_depth) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = io_uring_setup(queue_depth, &params);
+    if (fd < 0) return false;
+    ring_fd = fd;
+    entries = params.sq_entries;
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    // kernels with SINGLE_MMAP put both rings in one mapping
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        sq_ring_size = cq_ring_size = max(sq_ring_size, cq_ring_size);
+    }
+
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        sq_ring = nullptr;
+        return false;
+    }
+    if (single_mmap) {
+        cq_ring = sq_ring;
+    } else {
+        cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            cq_ring = nullptr;
+            return false;
+        }
+    }
+
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        sqes = nullptr;
+        return false;
+    }
+
+    sq_head = ring_field(sq_ring, params.sq_off.head);
+    sq_tail = ring_field(sq_ring, params.sq_off.tail);
+    sq_mask = ring_field(sq_ring, params.sq_off.ring_mask);
+    sq_array = ring_field(sq_ring, params.sq_off.array);
+    cq_head = ring_field(cq_ring, params.cq_off.head);
+    cq_tail = ring_field(cq_ring, params.cq_off.tail);
+    cq_mask = ring_field(cq_ring, params.cq_off.ring_mask);
+    cqes = (char*)cq_ring + params.cq_off.cqes;
+    local_tail = *sq_tail;
+    return true;
+}
+
+void* IoUring::next_sqe() {
+    unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if (local_tail - head >= entries) return nullptr;
+    unsigned index = local_tail & *sq_mask;
+    struct io_uring_sqe* sqe = (struct io_uring_sqe*)sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    local_tail++;
+    return sqe;
+}
+
+static void prep_rw(struct io_uring_sqe* sqe, int fd, bool fixed_file, const void* buf, unsigned len,
+                    uint64_t offset, int buf_index, uint64_t user_data, bool write) {
+    if (buf_index >= 0) {
+        sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->buf_index = (uint16_t)buf_index;
+    } else {
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    }
+    sqe->fd = fd;
+    if (fixed_file) sqe->flags |= IOSQE_FIXED_FILE;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+}
+
+bool IoUring::prep_read(int fd, bool fixed_file, void* buf, unsigned len, uint64_t offset, int buf_index, uint64_t user_data) {
+    struct io_uring_sqe* sqe = (struct io_uring_sqe*)next_sqe();
+    if (sqe == nullptr) return false;
+    prep_rw(sqe, fd, fixed_file, buf, len, offset, buf_index, user_data, false);
+    return true;
+}
+
+bool IoUring::prep_write(int fd, bool fixed_file, const void* buf, unsigned len, uint64_t offset, int buf_index, uint64_t user_data) {
+    struct io_uring_sqe* sqe = (struct io_uring_sqe*)next_sqe();
+    if (sqe == nullptr) return false;
+    prep_rw(sqe, fd, fixed_file, buf, len, offset, buf_index, user_data, true);
+    return true;
+}
+
+unsigned IoUring::publish() {
+    __atomic_store_n(sq_tail, local_tail, __ATOMIC_RELEASE);
+    // count everything the kernel has not consumed yet, including leftovers of a short submit
+    return local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+}
+
+int IoUring::enter(unsigned to_submit, unsigned wait_nr) {
+    if (to_submit == 0 && wait_nr == 0) return 0;
+    while (true) {
+        int ret = io_uring_enter(ring_fd, to_submit, wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0);
+        if (ret < 0 && errno == EINTR) continue;
+        return ret < 0 ? -errno : ret;
+    }
+}
+
+int IoUring::submit(unsigned wait_nr) {
+    return enter(publish(), wait_nr);
+}
+
+int IoUring::wait() {
+    return enter(0, 1);
+}
+
+bool IoUring::next_completion(UringCompletion& completion) {
+    unsigned head = *cq_head;
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) return false;
+    struct io_uring_cqe* cqe = (struct io_uring_cqe*)cqes + (head & *cq_mask);
+    completion.user_data = cqe->user_data;
+    completion.res = cqe->res;
+    __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool IoUring::register_buffers(const vector<iovec>& buffers) {
+    return io_uring_register(ring_fd, IORING_REGISTER_BUFFERS, buffers.data(), buffers.size()) == 0;
+}
+
+bool IoUring::register_file_table(unsigned slots) {
+    vector<int> fds(slots, -1);
+    return io_uring_register(ring_fd, IORING_REGISTER_FILES, fds.data(), slots) == 0;
+}
+
+bool IoUring::update_file(unsigned slot, int fd) {
+    struct io_uring_files_update update;
+    memset(&update, 0, sizeof(update));
+    update.offset = slot;
+    update.fds = (uint64_t)(uintptr_t)&fd;
+    return io_uring_register(ring_fd, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1;
+}
+
+bool IoUring::register_eventfd(int event_fd) {
+    return io_uring_register(ring_fd, IORING_REGISTER_EVENTFD, &event_fd, 1) == 0;
+}
+
+#else
+
+// built without io_uring: nothing ever gets set up, callers keep their syscall path
+IoUring::~IoUring() {}
+bool IoUring::init(unsigned) { return false; }
+void* IoUring::next_sqe() { return nullptr; }
+bool IoUring::prep_read(int, bool, void*, unsigned, uint64_t, int, uint64_t) { return false; }
+bool IoUring::prep_write(int, bool, const void*, unsigned, uint64_t, int, uint64_t) { return false; }
+unsigned IoUring::publish() { return 0; }
+int IoUring::enter(unsigned, unsigned) { return -1; }
+int IoUring::submit(unsigned) { return -1; }
+int IoUring::wait() { return -1; }
+bool IoUring::next_completion(UringCompletion&) { return false; }
+bool IoUring::register_buffers(const vector<iovec>&) { return false; }
+bool IoUring::register_file_table(unsigned) { return false; }
+bool IoUring::update_file(unsigned, int) { return false; }
+bool IoUring::register_eventfd(int) { return false; }
+
+#endif
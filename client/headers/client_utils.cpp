@@ -1,5 +1,7 @@
 #include "./utils_header.h"
 #include "file_header.h"
+#include "config_header.h"
+#include "thread_header.h"
 #include <sys/stat.h>
 #include <bits/stdc++.h>
 #include <string>
@@ -222,102 +224,156 @@ bool validate_file_existence(const string& file_path){
     return (stat(file_path.c_str(), &buffer) == 0);
 }
 
-string calculate_SHA(const string& piece_data) {
-    if (piece_data.empty()) {
-        cerr << "Empty piece data, cannot calculate SHA\n";
-        return "";
-    }
-
-    vector<char> buffer(piece_data.begin(), piece_data.end());
-
-    // SHA256 calculation
-    unsigned char piece_hash[SHA256_DIGEST_LENGTH];
-    SHA256_CTX piece_ctx;
-    SHA256_Init(&piece_ctx);
-    SHA256_Update(&piece_ctx, buffer.data(), buffer.size());
-    SHA256_Final(piece_hash, &piece_ctx);
-
-    // Convert hash to hex string
-    char output[2 * SHA256_DIGEST_LENGTH + 1];
-    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
-        sprintf(output + (i * 2), "%02x", piece_hash[i]);
-    }
-    output[2 * SHA256_DIGEST_LENGTH] = 0;
-
-    return string(output);
+// OpenSSL picks its SHA-NI / AVX2 code path at runtime, so every hash below uses them when the CPU has them
+Digest calculate_SHA(const string& piece_data) {
+    return calculate_SHA(piece_data.data(), piece_data.size());
 }
 
-// -------------------- Full file SHA --------------------
-string calculate_full_file_SHA(const string& file_path) {
-    int fd = open(file_path.c_str(), O_RDONLY);
-    if (fd < 0) {
-        perror(("open " + file_path).c_str());
-        return "";
+Digest calculate_SHA(const char* data, size_t len) {
+    Digest digest{};
+    if (len == 0) {
+        cerr << "Empty piece data, cannot calculate SHA\n";
+        return digest;
     }
+    SHA256(reinterpret_cast<const unsigned char*>(data), len, digest.data());
+    return digest;
+}
 
-    SHA256_CTX sha256;
-    SHA256_Init(&sha256);
-
-    const size_t BUF_SIZE = 512 * 1024; // 512 KB buffer
-    vector<char> buffer(BUF_SIZE);
-
-    ssize_t bytes_read;
-    while ((bytes_read = read(fd, buffer.data(), BUF_SIZE)) > 0) {
-        SHA256_Update(&sha256, buffer.data(), bytes_read);
+// -------------------- Full file SHA (Merkle root) --------------------
+// full_SHA is the root of a binary Merkle tree over the piece digests: each level hashes adjacent
+// pairs of digests, a lone last node moves up unchanged. A downloader whose pieces all matched
+// piece_SHA only has to rebuild the root from the list, it never re-reads the file.
+Digest calculate_merkle_root(const vector<Digest>& piece_SHA) {
+    Digest root{};
+    if (piece_SHA.empty()) {
+        SHA256(nullptr, 0, root.data());
+        return root;
     }
 
-    if (bytes_read < 0) {
-        perror(("read " + file_path).c_str());
-        close(fd);
-        return "";
+    // the digests are contiguous, so each level is hashed pairwise in place
+    vector<Digest> level = piece_SHA;
+    size_t nodes = level.size();
+    while (nodes > 1) {
+        size_t parents = (nodes + 1) / 2;
+        for (size_t i = 0; i < parents; ++i) {
+            Digest parent;
+            if (2 * i + 1 < nodes) SHA256(level[2 * i].data(), 2 * DIGEST_SIZE, parent.data());
+            else parent = level[2 * i];
+            level[i] = parent;
+        }
+        nodes = parents;
     }
-
-    close(fd);
-
-    unsigned char hash[SHA256_DIGEST_LENGTH];
-    SHA256_Final(hash, &sha256);
-
-    char hex[2 * SHA256_DIGEST_LENGTH + 1];
-    for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i)
-        sprintf(hex + i * 2, "%02x", hash[i]);
-    hex[2 * SHA256_DIGEST_LENGTH] = '\0';
-
-    return string(hex);
+    return level[0];
 }
 
-// -------------------- Piece-wise SHA --------------------
-vector<string> calculate_piece_SHA(const string& file_path, uint64_t piece_size) {
-    vector<string> pieces;
-
-    int fd = open(file_path.c_str(), O_RDONLY);
+// -------------------- Piece-wise SHA + Merkle root in one pass --------------------
+// the calling thread reads the file once, piece by piece, and the shared executor hashes the pieces
+// in any order. read buffers come from a fixed budget (FILE_HASH_BUFFER_BYTES) and return to it once
+// hashed, so a 16MB piece size does not multiply memory by the core count. the executor may be busy
+// with download loops: a reader that runs out of buffers hashes a queued piece itself instead of waiting.
+bool calculate_file_SHA(const string& file_path, uint64_t piece_size, Digest& full_SHA, vector<Digest>& piece_SHA) {
+    int fd = open(file_path.c_str(), O_RDONLY | O_CLOEXEC);
     if (fd < 0) {
         perror(("open " + file_path).c_str());
-        return pieces;
+        return false;
     }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    struct Chunk {
+        size_t index;
+        vector<char> data;
+        size_t len = 0;
+    };
+    // shared with the hashing tasks; one that starts after the call returned finds nothing queued
+    struct HashState {
+        mutex m;
+        condition_variable cv;
+        vector<Chunk> chunks;
+        vector<Chunk*> free_chunks;
+        deque<Chunk*> piece_queue;
+        size_t hashing = 0;
+        vector<Digest>* piece_SHA;
+    };
+
+    size_t buffer_count = max<size_t>(2, min<size_t>(executor().size() + 2, FILE_HASH_BUFFER_BYTES / piece_size));
+    auto state = make_shared<HashState>();
+    state->chunks.resize(buffer_count);
+    for (Chunk& chunk : state->chunks) {
+        chunk.data.resize(piece_size);
+        state->free_chunks.push_back(&chunk);
+    }
+    state->piece_SHA = &piece_SHA;
+    piece_SHA.clear();
+
+    // hash the oldest queued piece, false when none is queued; `lock` is held on return
+    auto hash_one = [](HashState& st, unique_lock<mutex>& lock) {
+        if (st.piece_queue.empty()) return false;
+        Chunk* chunk = st.piece_queue.front();
+        st.piece_queue.pop_front();
+        st.hashing++;
+        lock.unlock();
+        Digest digest;
+        SHA256(reinterpret_cast<const unsigned char*>(chunk->data.data()), chunk->len, digest.data());
+        lock.lock();
+        (*st.piece_SHA)[chunk->index] = digest;
+        st.free_chunks.push_back(chunk);
+        st.hashing--;
+        st.cv.notify_all();
+        return true;
+    };
+
+    bool ok = true;
+    for (size_t index = 0; ok; ++index) {
+        Chunk* chunk;
+        {
+            unique_lock<mutex> lock(state->m);
+            while (state->free_chunks.empty()) {
+                if (!hash_one(*state, lock)) state->cv.wait(lock);
+            }
+            chunk = state->free_chunks.back();
+            state->free_chunks.pop_back();
+        }
 
-    vector<char> buffer(piece_size);
-    ssize_t bytes_read;
-
-    while ((bytes_read = read(fd, buffer.data(), piece_size)) > 0) {
-        SHA256_CTX sha256;
-        SHA256_Init(&sha256);
-        SHA256_Update(&sha256, buffer.data(), bytes_read);
-
-        unsigned char hash[SHA256_DIGEST_LENGTH];
-        SHA256_Final(hash, &sha256);
-
-        char hex[2 * SHA256_DIGEST_LENGTH + 1];
-        for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i)
-            sprintf(hex + i * 2, "%02x", hash[i]);
-        hex[2 * SHA256_DIGEST_LENGTH] = '\0';
+        chunk->len = 0;
+        while (chunk->len < piece_size) {
+            ssize_t r = read(fd, chunk->data.data() + chunk->len, piece_size - chunk->len);
+            if (r < 0 && errno == EINTR) continue;
+            if (r < 0) {
+                perror(("read " + file_path).c_str());
+                ok = false;
+            }
+            if (r <= 0) break;
+            chunk->len += r;
+        }
 
-        pieces.push_back(string(hex));
+        {
+            lock_guard<mutex> lock(state->m);
+            if (chunk->len == 0) {
+                state->free_chunks.push_back(chunk);
+                break;
+            }
+            chunk->index = index;
+            piece_SHA.emplace_back();
+            state->piece_queue.push_back(chunk);
+        }
+        executor().submit([state, hash_one]() {
+            unique_lock<mutex> lock(state->m);
+            hash_one(*state, lock);
+        });
+        if (chunk->len < piece_size) break;     // short read: end of file
     }
 
-    if (bytes_read < 0) perror(("read " + file_path).c_str());
-
+    // whatever no worker picked up yet is hashed here, then the pieces still being hashed are awaited
+    {
+        unique_lock<mutex> lock(state->m);
+        while (hash_one(*state, lock)) {}
+        state->cv.wait(lock, [&] { return state->hashing == 0; });
+    }
     close(fd);
-    return pieces;
+    if (!ok) return false;
+
+    full_SHA = calculate_merkle_root(piece_SHA);
+    return true;
 }
 
 // Generate FileInfo message
@@ -340,20 +396,19 @@ string generate_file_message(const string& command, const string& username, cons
     }
     fileInfo.owner = username;
     fileInfo.group = tokens[1];
-    fileInfo.piece_size = 512 * 1024; // 512 KB
 
     struct stat st;
     if (stat(file_path.c_str(), &st) != 0) return "";
     fileInfo.size = st.st_size;
+    fileInfo.piece_size = choose_piece_size(fileInfo.size, client_config().piece_size);
 
-    fileInfo.full_SHA = calculate_full_file_SHA(file_path);
-    fileInfo.piece_SHA = calculate_piece_SHA(file_path, fileInfo.piece_size);
+    if (!calculate_file_SHA(file_path, fileInfo.piece_size, fileInfo.full_SHA, fileInfo.piece_SHA)) return "";
 
     fileInfo.seeder_users[username] = Address{ip, port};
 
     fileInfo.user_file_map[username] = fileInfo.path;
 
-    return fileInfo.toString();
+    return fileInfo.encode();
 }
 
 bool create_file(const string& path, uint64_t size) {
@@ -0,0 +1,20 @@
+#pragma once
+#ifndef CONFIG_HEADER_H
+#define CONFIG_HEADER_H
+
+#include <string>
+using namespace std;
+
+// Runtime knobs of the client, read once from the environment so the same
+// binary can be benchmarked with different settings on the same box.
+struct ClientConfig {
+    bool zero_copy;         // P2P_ZERO_COPY (default 1): serve pieces with sendfile64 instead of read/send
+    int pipeline_depth;     // P2P_PIPELINE_DEPTH (default 0 = auto): get_piece requests in flight per seeder
+    bool io_uring;          // P2P_IO_URING (default 0): piece disk I/O through io_uring, needs a build with IO_URING=1
+    bool mmap_writes;       // P2P_MMAP_WRITES (default 0): receive pieces straight into a shared mapping of the destination
+    long piece_size;        // P2P_PIECE_SIZE (default 0 = by file size): piece size in bytes of the files this client uploads
+};
+
+const ClientConfig& client_config();
+
+#endif
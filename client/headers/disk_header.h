@@ -0,0 +1,241 @@
+#pragma once
+#ifndef DISK_HEADER_H
+#define DISK_HEADER_H
+
+#include <bits/stdc++.h>
+#include <string>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <sys/stat.h>
+#include "./uring_header.h"
+#include "./file_header.h"
+using namespace std;
+
+// ------------------------------------------------------- PIECE BUFFERS -------------------------------------------------------
+// Page-aligned piece buffers recycled through a process-wide pool: a downloader receives a piece
+// into one, hashes it there and hands the same buffer to the writer, which returns it to the pool
+// once the write is done. Once the pool is warm a download allocates nothing per piece and the
+// bytes are never copied between the socket and the file.
+
+const size_t PIECE_BUFFER_ALIGN = 4096;
+// idle buffers the pool keeps for reuse, larger surpluses go back to the allocator
+const size_t PIECE_BUFFER_POOL_BYTES = 64ULL * 1024 * 1024;
+
+// move-only handle, gives its memory back to the pool when destroyed
+class PieceBuffer {
+private:
+    char* bytes = nullptr;
+    size_t capacity = 0;
+    size_t length = 0;
+
+public:
+    PieceBuffer() = default;
+    PieceBuffer(char* bytes, size_t capacity, size_t length) : bytes(bytes), capacity(capacity), length(length) {}
+    ~PieceBuffer();
+    PieceBuffer(PieceBuffer&& other) noexcept;
+    PieceBuffer& operator=(PieceBuffer&& other) noexcept;
+    PieceBuffer(const PieceBuffer&) = delete;
+    PieceBuffer& operator=(const PieceBuffer&) = delete;
+
+    char* data() { return bytes; }
+    const char* data() const { return bytes; }
+    size_t size() const { return length; }
+};
+
+class PieceBufferPool {
+private:
+    mutex m;
+    unordered_map<size_t, vector<char*>> idle;   // by capacity, a multiple of PIECE_BUFFER_ALIGN
+    size_t idle_bytes = 0;
+
+public:
+    // a buffer of `size` bytes, contents undefined; throws bad_alloc when memory is exhausted
+    PieceBuffer acquire(size_t size);
+    void release(char* bytes, size_t capacity);
+};
+
+PieceBufferPool& piece_buffers();
+
+// ------------------------------------------------------- PIECE WRITER -------------------------------------------------------
+// Writes verified pieces into the destination file. With P2P_IO_URING=1 writes go through one
+// shared ring: callers only queue them, whoever is first submits everything queued meanwhile in a
+// single io_uring_enter, and a completion thread reports each result. Without it (or when the
+// kernel refuses io_uring) the write is a plain pwrite loop on the caller's thread.
+
+const unsigned PIECE_WRITER_DEPTH = 64;         // writes in flight, each holds one piece in memory
+const unsigned PIECE_WRITER_FILE_SLOTS = 64;    // registered destination files
+
+class PieceWriter {
+public:
+    using Done = function<void(bool written)>;
+
+    PieceWriter();
+    PieceWriter(const PieceWriter&) = delete;
+    PieceWriter& operator=(const PieceWriter&) = delete;
+
+    bool async() const { return ring.ready(); }
+
+    // register a destination once per download, returns its slot or -1 (writes then use the plain fd)
+    int register_file(int fd);
+    void unregister_file(int slot);
+
+    // `data` stays alive until the write finished and goes back to the pool after `done`, which runs
+    // on the completion thread, or inline when writes are synchronous
+    void write(int fd, int slot, uint64_t offset, PieceBuffer data, Done done);
+
+private:
+    struct Request {
+        int fd;
+        int slot;
+        uint64_t offset;
+        PieceBuffer data;
+        size_t written;
+        Done done;
+    };
+
+    IoUring ring;
+    mutex m;
+    condition_variable space_cv;
+    unordered_map<uint64_t, unique_ptr<Request>> in_flight;
+    uint64_t next_id = 1;
+    unsigned unsubmitted = 0;
+    bool submitting = false;
+    vector<bool> slot_used;
+    thread completion_thread;
+
+    bool queue_locked(uint64_t id, Request& request);
+    void submit_queued(unique_lock<mutex>& lock);
+    void completion_loop();
+};
+
+// process-wide writer shared by all downloads
+PieceWriter& piece_writer();
+
+// ------------------------------------------------------- MAPPED FILE -------------------------------------------------------
+// Shared writable mapping of a download's destination (P2P_MMAP_WRITES=1). A piece is received
+// straight into its place in the file and hashed there, no heap buffer or pwrite in between; the
+// destination already has its full size from create_file. The file must not shrink while mapped.
+
+class MappedFile {
+private:
+    char* base = nullptr;
+    uint64_t length = 0;
+    int fd = -1;
+
+public:
+    MappedFile() = default;
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // `fd` must be open for reading and writing and stay open while mapped
+    bool map(int fd, uint64_t size);
+    char* at(uint64_t offset) { return base + offset; }
+    // start writeback of a finished piece without waiting for it
+    void flush(uint64_t offset, uint64_t len);
+};
+
+// ------------------------------------------------------- FD CACHE -------------------------------------------------------
+// Open descriptors of shared and downloading files, keyed by path and access mode, so serving or
+// writing a piece needs no path lookup. Entries are reference counted: eviction or invalidation only
+// drops the cache's reference, a piece still being sent keeps its descriptor open. A cached entry is
+// trusted for FD_CACHE_REVALIDATE_MS, after that one stat64 checks that the path still names the same
+// unchanged file (device, inode, size, mtime) and reopens it otherwise.
+
+const size_t FD_CACHE_CAPACITY = 256;
+const int FD_CACHE_REVALIDATE_MS = 1000;
+
+struct OpenFile {
+    int fd;
+    uint64_t size;
+    dev_t dev;
+    ino_t ino;
+    timespec mtime;
+
+    OpenFile(int fd, const struct stat64& st);
+    ~OpenFile();
+    OpenFile(const OpenFile&) = delete;
+    OpenFile& operator=(const OpenFile&) = delete;
+};
+
+class FdCache {
+public:
+    // nullptr when the file can not be opened; a writable descriptor can read back what it wrote
+    shared_ptr<OpenFile> acquire(const string& path, bool writable);
+    // drop the cached descriptors of `path`, or of every path whose file name is `file_name`
+    void invalidate(const string& path);
+    void invalidate_name(const string& file_name);
+
+private:
+    struct Entry {
+        string path;
+        shared_ptr<OpenFile> file;
+        chrono::steady_clock::time_point checked_at;
+        list<string>::iterator lru_pos;
+    };
+
+    mutex m;
+    unordered_map<string, Entry> entries;       // "r:" / "w:" + path
+    list<string> lru;                           // most recently used key first
+
+    void erase_locked(unordered_map<string, Entry>::iterator it);
+};
+
+// process-wide cache shared by the peer server and the downloader
+FdCache& fd_cache();
+
+// ------------------------------------------------------- PIECE JOURNAL -------------------------------------------------------
+// Progress of one download: a bitfield of the pieces verified and written, kept in a sidecar file
+// next to the destination and mapped into memory:
+//
+//     "PJ" u8 version | full_SHA (32 bytes) | u64 size | u64 piece_size | u32 pieces | bitfield
+//
+// Download loops set bits with atomic ors on the mapping, without a lock; show_downloads and the
+// completion check read the same bits. 10^6 pieces take ~128 KB. A piece's bit is set right after
+// the piece is written and the page cache keeps it when the process dies, so a download_file issued
+// again only fetches the rest; pieces whose data did not reach the disk before a power loss are
+// caught when a resumed download verifies them again. The journal is removed once the download
+// completes.
+
+const char PIECE_JOURNAL_MAGIC[2] = {'P', 'J'};
+const uint8_t PIECE_JOURNAL_VERSION = 1;
+const string PIECE_JOURNAL_SUFFIX = ".p2pjournal";
+const size_t PIECE_JOURNAL_HEADER_SIZE = sizeof(PIECE_JOURNAL_MAGIC) + 1 + DIGEST_SIZE + 8 + 8 + 4;
+
+class PieceJournal {
+private:
+    string path;
+    uint8_t* mapping = nullptr;     // header followed by the bitfield
+    size_t mapping_size = 0;
+    uint8_t* bits = nullptr;
+    size_t pieces = 0;
+    bool persistent = false;
+
+    bool map_file(const string& header);
+    bool map_anonymous();
+
+public:
+    PieceJournal() = default;
+    ~PieceJournal();
+    PieceJournal(const PieceJournal&) = delete;
+    PieceJournal& operator=(const PieceJournal&) = delete;
+
+    // maps the journal of `destination`; its bits are kept only when it describes the same file,
+    // otherwise it starts empty. When no file can back it progress is kept in memory only and the
+    // download can not be resumed (resumable()); false when not even that memory can be mapped
+    bool open(const string& destination, const Digest& full_SHA, uint64_t size, uint64_t piece_size, size_t pieces);
+    bool resumable() const { return persistent; }
+    size_t total() const { return pieces; }
+    bool has(size_t piece) const;
+    void mark(size_t piece);
+    void clear(size_t piece);
+    size_t count() const;
+    // lowest piece whose bit is clear, total() when every piece is written
+    size_t first_missing() const;
+    // the download is complete (or can not be resumed), drop the file; the bits stay readable
+    void remove();
+};
+
+#endif
@@ -0,0 +1,201 @@
+#pragma once
+#ifndef DOWNLOAD_HEADER_H
+#define DOWNLOAD_HEADER_H
+
+#include <bits/stdc++.h>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include "./file_header.h"
+using namespace std;
+
+// requests kept in flight per seeder before the first bandwidth/RTT samples arrive
+const int PIPELINE_INITIAL_DEPTH = 4;
+const int PIPELINE_MIN_DEPTH = 2;
+const int PIPELINE_MAX_DEPTH = 64;
+// once no more than this many pieces are unsettled, idle seeders fetch duplicates of in-flight ones
+const int ENDGAME_PIECES = 8;
+// an idle seeder that lacks pieces still unsettled asks for its bitfield again this often, a partial
+// seeder may have verified them since it was connected
+const int BITFIELD_REFRESH_SEC = 5;
+// pieces at least this large are fetched as blocks of SPLIT_BLOCK_SIZE with get_block, so several
+// seeders can deliver one piece at once
+const uint64_t SPLIT_PIECE_MIN_SIZE = 4 * 1024 * 1024;
+const uint64_t SPLIT_BLOCK_SIZE = 1024 * 1024;
+const int WHOLE_PIECE = -1;
+
+// one request handed to a seeder loop: a whole piece, or one block of a split piece
+struct PieceRequest {
+    int piece = 0;
+    int block = WHOLE_PIECE;
+};
+
+// ------------------------------------------------------- PIECE SCHEDULER -------------------------------------------------------
+// Shared by the per-seeder download loops of one file. Hands out pieces rarest first: a seeder gets
+// the pending piece held by the fewest live seeders among those it has itself. Takes back the
+// pieces a seeder could not deliver, and gives a piece up once every seeder holding it failed it
+// or went away.
+// Seeders report their measured speed. Near the end, when the swarm would finish what is left
+// sooner than a slow seeder could deliver one more piece, that seeder leaves the piece to a
+// faster one that holds it, so the tail of a download is not stuck behind a slow link.
+// Endgame: with at most ENDGAME_PIECES left, a seeder with nothing else to do also gets pieces
+// other seeders are still fetching. The first verified copy claims the piece, the others are
+// cancelled or dropped.
+// Split pieces (SPLIT_PIECE_MIN_SIZE and up) are handed out block by block. A seeder asking for
+// work first gets an unclaimed block of a piece already started, so idle seeders join a large
+// piece instead of opening another one; in endgame they duplicate blocks still in flight. The
+// first copy of a block is kept, the piece is verified once every block is in. A split piece
+// that fails verification is fetched whole from then on, so a bad block is blamed on its seeder.
+class PieceScheduler {
+private:
+    struct SeederSpeed {
+        double requests_per_sec = 0; // 0 until the first measurement
+        double rtt_sec = 0;
+        int outstanding = 0;         // pieces or blocks handed to the seeder and not settled yet
+    };
+    struct SplitPiece {
+        vector<unordered_set<string>> fetching;  // seeders each block is in flight on
+        vector<char> received;                   // blocks claimed by their first copy
+        int blocks_left;
+    };
+
+    // pending pieces bucketed by availability; an entry whose piece was handed out or moved to
+    // another bucket since is stale and dropped when a scan meets it
+    vector<deque<int>> pending;
+    vector<char> queued;
+    vector<int> availability;                        // live seeders holding each piece
+    vector<char> settled;                            // delivered or given up
+    vector<string> seeders;
+    unordered_map<string, Bitfield> seeder_pieces;   // a seeder without an entry holds every piece
+    unordered_map<int, unordered_set<string>> failed_by;
+    unordered_map<int, unordered_set<string>> fetching;   // seeders a piece is in flight on
+    unordered_map<int, string> claimed_by;           // verified copy being written
+    unordered_set<string> dead_seeders;
+    unordered_set<string> unannounced;               // live seeders whose bitfield has not arrived yet
+    unordered_map<string, SeederSpeed> speeds;
+    unordered_map<int, SplitPiece> split;            // split pieces whose blocks were handed out
+    vector<char> whole_only;                         // split pieces that failed verification once
+    int total_pieces;
+    uint64_t piece_size;
+    uint64_t file_size;
+    int blocks_per_piece;        // 1 when pieces are fetched whole
+    int known_pieces = 0;        // added so far, seeder loops wait for the rest instead of exiting
+    int in_flight = 0;
+    int resolved = 0;
+    mutex m;
+    condition_variable cv;
+
+    bool holds(const string& seeder, int piece);
+    bool usable_by(int piece, const string& seeder);
+    bool failed_everywhere(int piece);
+    void enqueue(int piece, bool front);
+    void change_availability(int piece, int delta);
+    vector<int> drop_unobtainable();
+    bool take_duplicate(const string& seeder, PieceRequest& request);
+    bool lacks_unsettled(const string& seeder);
+    bool take_block(const string& seeder, PieceRequest& request);
+    bool splits(int piece);
+    int block_count(int piece);
+    void hand_out(int piece, const string& seeder);
+    void hand_out_block(int piece, int block, const string& seeder);
+    void stop_fetching(int piece, const string& seeder);
+    void release_block(int piece, int block, const string& seeder);
+    bool requeue_if_orphaned(int piece);
+    double expected_finish(const string& seeder);
+    bool better_left_to_others(int piece, const string& seeder);
+
+public:
+    // starts with no pieces, they are added as their digests become known; `seeder_pieces` are the
+    // bitfields the tracker knows of partial seeders
+    PieceScheduler(int total_pieces, uint64_t piece_size, uint64_t file_size, const vector<string>& seeders,
+                   const map<string, Bitfield>& seeder_pieces);
+
+    // hand out these pieces from now on, returns the ones given up at once because no seeder is left
+    vector<int> add_pieces(const vector<int>& pieces);
+    // `count` pieces will never be added (their digests did not arrive), count them as given up
+    void abandon_pieces(int count);
+    // these pieces are already verified on disk (a resumed download), count them as delivered
+    void settle_pieces(const vector<int>& pieces);
+
+    // next piece or block for `seeder`; with wait=true blocks until one is available, every piece is
+    // settled, or BITFIELD_REFRESH_SEC passed while `seeder` lacks pieces still unsettled: false then
+    // asks the caller to refresh the seeder's bitfield, unless done() says nothing is left to do
+    bool next_request(const string& seeder, PieceRequest& request, bool wait);
+    bool done();
+    // bytes of one request: SPLIT_BLOCK_SIZE when pieces are split, the piece size otherwise
+    uint64_t request_size() const;
+    // the first copy of a block; false when another copy or the whole piece beat it
+    bool claim_block(int piece, int block);
+    // a claimed block is in the piece's buffer. Returns true when it was the last one: the piece is
+    // then claimed by `seeder`, to be verified and settled with piece_done or piece_failed
+    bool block_done(int piece, int block, const string& seeder);
+    // `seeder` does not have the block's piece after all, returns true when the piece is given up
+    bool block_failed(int piece, int block, const string& seeder);
+    // a block copy dropped without failing it, `claimed` gives back the claim it took. Returns true
+    // when the piece is given up
+    bool block_abandoned(int piece, int block, const string& seeder, bool claimed = false);
+    // a verified copy from `seeder`; false when another copy already claimed the piece
+    bool claim(int piece, const string& seeder);
+    // claim a piece before its bytes arrive, so they can be received straight into the destination:
+    // no duplicate is handed out or written over it. false in endgame or while another seeder
+    // fetches the piece too
+    bool claim_in_place(int piece, const string& seeder);
+    void piece_done(int piece, const string& seeder);
+    // returns true when the piece is given up because no seeder is left to try it
+    bool piece_failed(int piece, const string& seeder);
+    // `seeder` gave up its copy without failing it (cancelled or beaten by another copy),
+    // returns true when the piece is given up because of it
+    bool piece_abandoned(int piece, const string& seeder);
+    bool finished(int piece);
+    bool endgame();
+    // EWMA throughput (in requests of request_size()) and round trip time of `seeder`, from its PipelineTuner
+    void report_speed(const string& seeder, double requests_per_sec, double rtt_sec);
+    // the connection to `seeder` is gone: its unfinished pieces and blocks go back to the others,
+    // returns the pieces that are given up because of it
+    vector<int> seeder_gone(const string& seeder, const vector<PieceRequest>& unfinished);
+    // `seeder` announced the pieces it holds, returns the pieces nobody is left to deliver
+    vector<int> set_seeder_pieces(const string& seeder, const Bitfield& bits);
+    // true once every piece is settled, false when `timeout` passed first
+    bool wait_until_finished(chrono::seconds timeout);
+};
+
+// ------------------------------------------------------- LOCAL PIECES -------------------------------------------------------
+// Verified pieces of the files this client is downloading, by the path they are shared under.
+// The peer server announces them on get_bitfield; a file that is not tracked here is complete.
+class LocalPieces {
+private:
+    unordered_map<string, Bitfield> files;
+    mutex m;
+
+public:
+    void track(const string& path, size_t total_pieces);
+    void mark(const string& path, int piece);
+    void untrack(const string& path);
+    // false when `path` is not being downloaded
+    bool bitfield(const string& path, Bitfield& bits);
+    // true when `path` is being downloaded and `piece` is not verified yet
+    bool missing(const string& path, int piece);
+};
+
+// update_pieces lines the tracker still accepts (its MAX_LINE_SIZE), enough for ~250k pieces
+const size_t MAX_PIECES_ANNOUNCE_LINE = 64 * 1024;
+
+LocalPieces& local_pieces();
+
+// ------------------------------------------------------- PIPELINE TUNER -------------------------------------------------------
+// Bandwidth-delay estimate of one seeder link, used to size its request pipeline.
+class PipelineTuner {
+private:
+    double rtt_sec = 0;          // EWMA, request sent on an idle link -> frame header received
+    double bytes_per_sec = 0;    // EWMA, frame header -> last piece byte
+
+public:
+    void on_rtt_sample(double seconds);
+    void on_transfer_sample(uint64_t bytes, double seconds);
+    double bandwidth() const { return bytes_per_sec; }
+    double rtt() const { return rtt_sec; }
+    // `configured` > 0 pins the depth, 0 auto-tunes it from the bandwidth-delay product
+    int depth(uint64_t piece_size, int configured) const;
+};
+
+#endif
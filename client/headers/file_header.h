@@ -11,117 +11,308 @@ struct Address {
     int port;
 };
 
+// SHA-256 digest as raw bytes; hex only appears where a digest is printed or put into a text message
+const size_t DIGEST_SIZE = 32;
+using Digest = array<unsigned char, DIGEST_SIZE>;
+
+inline string digest_to_hex(const Digest& digest) {
+    static const char digits[] = "0123456789abcdef";
+    string hex(2 * DIGEST_SIZE, '0');
+    for (size_t i = 0; i < DIGEST_SIZE; ++i) {
+        hex[2 * i] = digits[digest[i] >> 4];
+        hex[2 * i + 1] = digits[digest[i] & 0x0f];
+    }
+    return hex;
+}
+
+// Piece bitfield of a seeder that holds only part of a file: bit i (most significant bit of byte
+// i / 8 first) is set when piece i is there. A seeder without a bitfield holds the whole file.
+using Bitfield = vector<uint8_t>;
+
+inline size_t bitfield_size(size_t pieces) { return (pieces + 7) / 8; }
+inline bool bitfield_has(const Bitfield& bits, size_t piece) {
+    return piece / 8 < bits.size() && (bits[piece / 8] & (0x80 >> (piece % 8))) != 0;
+}
+inline void bitfield_set(Bitfield& bits, size_t piece) { bits[piece / 8] |= 0x80 >> (piece % 8); }
+
+// bitfields go hex encoded into text commands (update_pieces)
+inline string bitfield_to_hex(const Bitfield& bits) {
+    static const char digits[] = "0123456789abcdef";
+    string hex(2 * bits.size(), '0');
+    for (size_t i = 0; i < bits.size(); ++i) {
+        hex[2 * i] = digits[bits[i] >> 4];
+        hex[2 * i + 1] = digits[bits[i] & 0x0f];
+    }
+    return hex;
+}
+
+inline bool hex_to_bitfield(const string& hex, Bitfield& bits) {
+    auto value = [](char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    };
+    if (hex.size() % 2 != 0) return false;
+    bits.assign(hex.size() / 2, 0);
+    for (size_t i = 0; i < bits.size(); ++i) {
+        int high = value(hex[2 * i]), low = value(hex[2 * i + 1]);
+        if (high < 0 || low < 0) return false;
+        bits[i] = (uint8_t)(high << 4 | low);
+    }
+    return true;
+}
+
+// ------------------------------------------------------- PIECE SIZE -------------------------------------------------------
+// Every file has its own piece size, picked by the uploader and carried in FileInfo. Left to the
+// uploader it grows with the file (a power of two aiming at PIECE_SIZE_TARGET_PIECES pieces), so
+// huge files do not turn into millions of pieces and megabytes of piece digests.
+
+const uint64_t DEFAULT_PIECE_SIZE = 512 * 1024;          // files shared before piece sizes varied
+const uint64_t MIN_PIECE_SIZE = 16 * 1024;
+const uint64_t MAX_PIECE_SIZE = 16 * 1024 * 1024;
+const uint64_t MIN_AUTO_PIECE_SIZE = 256 * 1024;
+const uint64_t PIECE_SIZE_TARGET_PIECES = 2048;
+
+inline bool valid_piece_size(uint64_t piece_size) {
+    return piece_size >= MIN_PIECE_SIZE && piece_size <= MAX_PIECE_SIZE;
+}
+
+// `configured` > 0 is used as is (clamped to the valid range), 0 picks the size from the file size
+inline uint64_t choose_piece_size(uint64_t file_size, uint64_t configured) {
+    if (configured > 0) return min(MAX_PIECE_SIZE, max(MIN_PIECE_SIZE, configured));
+    uint64_t piece_size = MIN_AUTO_PIECE_SIZE;
+    while (piece_size < MAX_PIECE_SIZE && piece_size * PIECE_SIZE_TARGET_PIECES < file_size) piece_size *= 2;
+    return piece_size;
+}
+
+// ------------------------------------------------------- WIRE FORMAT -------------------------------------------------------
+// FileInfo travels in a versioned binary encoding, all integers in network byte order:
+//
+//     "FI" u8 version | u64 size | u64 piece_size | str name | str path | str owner | str group
+//     | full_SHA (32 bytes) | u32 n + n piece digests (32 bytes each, back to back)
+//     | u32 n + n * (str user | str ip | u16 port) | u32 n + n * (str user | str path)
+//     | u32 n + n * (str user | str bitfield)                                   (version 2)
+//
+// where str is a u32 length followed by the bytes. Decoding does not copy: FileInfoView points into
+// the receive buffer, FileInfo::fromView materializes it when the data has to outlive the buffer.
+
+const char FILE_INFO_MAGIC[2] = {'F', 'I'};
+const uint8_t FILE_INFO_VERSION = 2;
+// largest file_data reply accepted from the tracker, the same bound the tracker puts on an upload
+const uint64_t MAX_METADATA_SIZE = 256ULL * 1024 * 1024;
+
+class WireWriter {
+public:
+    string out;
+
+    void u8(uint8_t v) { out.push_back((char)v); }
+    void u16(uint16_t v) { for (int s = 8; s >= 0; s -= 8) out.push_back((char)(v >> s)); }
+    void u32(uint32_t v) { for (int s = 24; s >= 0; s -= 8) out.push_back((char)(v >> s)); }
+    void u64(uint64_t v) { for (int s = 56; s >= 0; s -= 8) out.push_back((char)(v >> s)); }
+    void bytes(const void* data, size_t len) { out.append((const char*)data, len); }
+    void str(const string& s) { u32((uint32_t)s.size()); bytes(s.data(), s.size()); }
+};
+
+// every read checks the remaining length; after the first short read `ok` stays false
+class WireReader {
+public:
+    explicit WireReader(string_view in) : in(in) {}
+    bool ok = true;
+
+    const unsigned char* take(size_t len) {
+        if (!ok || in.size() - pos < len) {
+            ok = false;
+            return nullptr;
+        }
+        const unsigned char* p = (const unsigned char*)in.data() + pos;
+        pos += len;
+        return p;
+    }
+    uint64_t uint(size_t width) {
+        const unsigned char* p = take(width);
+        uint64_t v = 0;
+        for (size_t i = 0; p != nullptr && i < width; ++i) v = v << 8 | p[i];
+        return v;
+    }
+    uint8_t u8() { return (uint8_t)uint(1); }
+    uint16_t u16() { return (uint16_t)uint(2); }
+    uint32_t u32() { return (uint32_t)uint(4); }
+    uint64_t u64() { return uint(8); }
+    string_view str() {
+        uint32_t len = u32();
+        const unsigned char* p = take(len);
+        return p == nullptr ? string_view() : string_view((const char*)p, len);
+    }
+    bool done() const { return ok && pos == in.size(); }
+
+private:
+    string_view in;
+    size_t pos = 0;
+};
+
+// decoded FileInfo that only points into the buffer it was parsed from
+struct FileInfoView {
+    string_view name;
+    string_view path;
+    string_view owner;
+    string_view group;
+    uint64_t size = 0;
+    uint64_t piece_size = 0;
+    Digest full_SHA{};
+    const unsigned char* piece_digests = nullptr;   // piece_count * DIGEST_SIZE bytes
+    size_t piece_count = 0;
+    vector<pair<string_view, pair<string_view, int>>> seeder_users;
+    vector<pair<string_view, string_view>> user_file_map;
+    vector<pair<string_view, string_view>> seeder_pieces;
+
+    // false for a wrong magic/version or a truncated or oversized buffer
+    static bool parse(string_view data, FileInfoView& view) {
+        WireReader r(data);
+        const unsigned char* magic = r.take(sizeof(FILE_INFO_MAGIC));
+        if (magic == nullptr || memcmp(magic, FILE_INFO_MAGIC, sizeof(FILE_INFO_MAGIC)) != 0) return false;
+        uint8_t version = r.u8();
+        if (version < 1 || version > FILE_INFO_VERSION) return false;
+
+        view.size = r.u64();
+        view.piece_size = r.u64();
+        view.name = r.str();
+        view.path = r.str();
+        view.owner = r.str();
+        view.group = r.str();
+        const unsigned char* full = r.take(DIGEST_SIZE);
+        if (full != nullptr) memcpy(view.full_SHA.data(), full, DIGEST_SIZE);
+
+        view.piece_count = r.u32();
+        view.piece_digests = r.take(view.piece_count * DIGEST_SIZE);
+
+        uint32_t seeders = r.u32();
+        for (uint32_t i = 0; i < seeders && r.ok; ++i) {
+            string_view user = r.str();
+            string_view ip = r.str();
+            int port = r.u16();
+            view.seeder_users.push_back({user, {ip, port}});
+        }
+        uint32_t files = r.u32();
+        for (uint32_t i = 0; i < files && r.ok; ++i) {
+            string_view user = r.str();
+            string_view file = r.str();
+            view.user_file_map.push_back({user, file});
+        }
+        // version 1 encodings end here, every seeder holds the whole file
+        uint32_t partial = version >= 2 ? r.u32() : 0;
+        for (uint32_t i = 0; i < partial && r.ok; ++i) {
+            string_view user = r.str();
+            string_view bits = r.str();
+            view.seeder_pieces.push_back({user, bits});
+        }
+        return r.done();
+    }
+};
+
 struct FileInfo {
-    // Order: name|path|owner|group|size|piece_size|full_SHA|piece_SHA (comma separated)|piece_users (piece:comma separated users)
     string name;
     string path;
     string owner;
     string group;
     uint64_t size;
     uint64_t piece_size;
-    string full_SHA;
-    vector<string> piece_SHA;
+    Digest full_SHA{};
+    vector<Digest> piece_SHA;           // contiguous, DIGEST_SIZE bytes per piece
     map<string, Address> seeder_users;
     map<string, string> user_file_map;
+    map<string, Bitfield> seeder_pieces;    // only for seeders that hold part of the file
 
-    // Serialize FileInfo to a string with '|' delimiter
-    string toString() const {
-        stringstream ss;
-        ss << name << "|" << path << "|" << owner << "|" << group << "|"
-           << size << "|" << piece_size << "|" << full_SHA << "|";
-
-        for (size_t i = 0; i < piece_SHA.size(); ++i) {
-            ss << piece_SHA[i];
-            if (i + 1 < piece_SHA.size()) ss << ",";
-        }
-        ss << "|";
-
-        bool first = true;
+    string encode() const {
+        WireWriter w;
+        w.out.reserve(128 + piece_SHA.size() * DIGEST_SIZE);
+        w.bytes(FILE_INFO_MAGIC, sizeof(FILE_INFO_MAGIC));
+        w.u8(FILE_INFO_VERSION);
+        w.u64(size);
+        w.u64(piece_size);
+        w.str(name);
+        w.str(path);
+        w.str(owner);
+        w.str(group);
+        w.bytes(full_SHA.data(), DIGEST_SIZE);
+        w.u32((uint32_t)piece_SHA.size());
+        w.bytes(piece_SHA.data(), piece_SHA.size() * DIGEST_SIZE);
+        w.u32((uint32_t)seeder_users.size());
         for (const auto& [user, addr] : seeder_users) {
-            if (!first) ss << ";";
-            ss << user << ":" << (addr.ip.empty() ? "0.0.0.0" : addr.ip) << ":" << addr.port;
-            first = false;
+            w.str(user);
+            w.str(addr.ip.empty() ? "0.0.0.0" : addr.ip);
+            w.u16((uint16_t)addr.port);
         }
-        ss << "|";
-
-        first = true;
+        w.u32((uint32_t)user_file_map.size());
         for (const auto& [user, file] : user_file_map) {
-            if (!first) ss << ";";
-            ss << user << ":" << file;
-            first = false;
+            w.str(user);
+            w.str(file);
         }
-
-        return ss.str();
+        w.u32((uint32_t)seeder_pieces.size());
+        for (const auto& [user, bits] : seeder_pieces) {
+            w.str(user);
+            w.u32((uint32_t)bits.size());
+            w.bytes(bits.data(), bits.size());
+        }
+        return w.out;
     }
 
-    // Deserialize a string to FileInfo
-    static FileInfo fromString(const std::string& data) {
+    static FileInfo fromView(const FileInfoView& view) {
+        static_assert(sizeof(Digest) == DIGEST_SIZE, "piece digests are copied as one block");
         FileInfo fileInfo;
-        std::stringstream ss(data);
-        std::string token;
-
-        // Basic fields
-        getline(ss, fileInfo.name, '|');
-        getline(ss, fileInfo.path, '|');
-        getline(ss, fileInfo.owner, '|');
-        getline(ss, fileInfo.group, '|');
-
-        std::string size_str, piece_size_str;
-        getline(ss, size_str, '|');
-        getline(ss, piece_size_str, '|');
-        fileInfo.size = size_str.empty() ? 0 : std::stoull(size_str);
-        fileInfo.piece_size = piece_size_str.empty() ? 0 : std::stoull(piece_size_str);
-
-        getline(ss, fileInfo.full_SHA, '|');
-
-        // piece_SHA (comma-separated)
-        std::string piece_sha_str;
-        getline(ss, piece_sha_str, '|');
-        {
-            std::stringstream piece_ss(piece_sha_str);
-            std::string piece;
-            while (getline(piece_ss, piece, ',')) {
-                if (!piece.empty()) fileInfo.piece_SHA.push_back(piece);
-            }
+        fileInfo.name = string(view.name);
+        fileInfo.path = string(view.path);
+        fileInfo.owner = string(view.owner);
+        fileInfo.group = string(view.group);
+        fileInfo.size = view.size;
+        fileInfo.piece_size = view.piece_size;
+        fileInfo.full_SHA = view.full_SHA;
+        fileInfo.piece_SHA.resize(view.piece_count);
+        if (view.piece_count > 0) memcpy(fileInfo.piece_SHA.data(), view.piece_digests, view.piece_count * DIGEST_SIZE);
+        for (const auto& [user, addr] : view.seeder_users) {
+            fileInfo.seeder_users[string(user)] = Address{string(addr.first), addr.second};
         }
-
-        // seeder_users (user:ip:port;...)
-        std::string seeder_str;
-        getline(ss, seeder_str, '|');
-        {
-            std::stringstream su_ss(seeder_str);
-            std::string entry;
-            while (getline(su_ss, entry, ';')) {
-                size_t first_colon = entry.find(':');
-                size_t second_colon = entry.find(':', first_colon + 1);
-                if (first_colon != std::string::npos && second_colon != std::string::npos) {
-                    std::string user = entry.substr(0, first_colon);
-                    std::string ip = entry.substr(first_colon + 1, second_colon - first_colon - 1);
-                    int port = std::stoi(entry.substr(second_colon + 1));
-                    fileInfo.seeder_users[user] = Address{ip, port};
-                }
-            }
+        for (const auto& [user, file] : view.user_file_map) {
+            fileInfo.user_file_map[string(user)] = string(file);
         }
-
-        // user_file_map (user:file;...)
-        std::string ufm_str;
-        getline(ss, ufm_str, '|');
-        {
-            std::stringstream ufm_ss(ufm_str);
-            std::string entry;
-            while (getline(ufm_ss, entry, ';')) {
-                size_t colon = entry.find(':');
-                if (colon != std::string::npos) {
-                    std::string user = entry.substr(0, colon);
-                    std::string file = entry.substr(colon + 1);
-                    fileInfo.user_file_map[user] = file;
-                }
-            }
+        for (const auto& [user, bits] : view.seeder_pieces) {
+            fileInfo.seeder_pieces[string(user)] = Bitfield(bits.begin(), bits.end());
         }
-
         return fileInfo;
     }
+
+    // false when `data` is not a valid encoding, `fileInfo` is then left untouched
+    static bool decode(string_view data, FileInfo& fileInfo) {
+        FileInfoView view;
+        if (!FileInfoView::parse(data, view)) return false;
+        fileInfo = fromView(view);
+        return true;
+    }
 };
 
+// Streamed metadata: the file_data_stream reply carries a FileInfo without piece digests, they follow
+// in order as separate length-prefixed frames of up to METADATA_CHUNK_PIECES digests each:
+//
+//     u32 first piece index | u32 n | n piece digests
+const size_t METADATA_CHUNK_PIECES = 4096;
+
+inline string encode_piece_chunk(const vector<Digest>& piece_SHA, size_t first, size_t count) {
+    WireWriter w;
+    w.out.reserve(8 + count * DIGEST_SIZE);
+    w.u32((uint32_t)first);
+    w.u32((uint32_t)count);
+    w.bytes(piece_SHA.data() + first, count * DIGEST_SIZE);
+    return w.out;
+}
+
+// `digests` points into `data`
+inline bool parse_piece_chunk(string_view data, size_t& first, size_t& count, const unsigned char*& digests) {
+    WireReader r(data);
+    first = r.u32();
+    count = r.u32();
+    digests = r.take(count * DIGEST_SIZE);
+    return r.done();
+}
+
 
 #endif
\ No newline at end of file
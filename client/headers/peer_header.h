@@ -0,0 +1,120 @@
+#pragma once
+#ifndef PEER_HEADER_H
+#define PEER_HEADER_H
+
+#include <bits/stdc++.h>
+#include <string>
+#include <mutex>
+#include <arpa/inet.h>
+#include <openssl/sha.h>
+#include "./file_header.h"
+using namespace std;
+
+static inline uint64_t htonll(uint64_t v) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return (((uint64_t)htonl((uint32_t)(v & 0xffffffffULL))) << 32) |
+           htonl((uint32_t)(v >> 32));
+#else
+    return v;
+#endif
+}
+static inline uint64_t ntohll(uint64_t v) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return (((uint64_t)ntohl((uint32_t)(v & 0xffffffffULL))) << 32) |
+           ntohl((uint32_t)(v >> 32));
+#else
+    return v;
+#endif
+}
+
+// ------------------------------------------------------- PEER PROTOCOL -------------------------------------------------------
+// A leecher keeps its connection to a seeder open and sends newline terminated requests on it:
+//     get_piece <file path> <piece index> <piece size>\n
+//     get_block <file path> <piece index> <offset> <length> <piece size>\n
+//     get_bitfield <file path> <piece size>\n
+//     cancel <file path> <piece index>\n
+// Every request is answered in order by a frame: 16 byte header, then `length` bytes of piece data
+// (for get_block the `length` bytes at `offset` within the piece), or for get_bitfield the bitfield
+// of the pieces the seeder holds (piece index 0). cancel has no frame of its own: a get_piece it
+// catches before the seeder started on it is answered with an empty PIECE_CANCELLED frame,
+// otherwise it is ignored. The piece size is the file's, from its FileInfo; requests without one
+// are from older leechers and mean DEFAULT_PIECE_SIZE.
+
+enum PieceStatus : uint32_t {
+    PIECE_OK = 0,
+    PIECE_UNAVAILABLE = 1,      // file missing or index out of range, the connection stays usable
+    PIECE_CANCELLED = 2,        // the leecher cancelled the request (endgame duplicate)
+};
+
+struct PieceFrameHeader {
+    uint32_t status;
+    uint32_t piece_index;
+    uint64_t length;
+};
+
+const size_t PIECE_FRAME_HEADER_SIZE = 16;
+
+// piece bytes taken off the socket per recv and hashed right away, while they are still in cache
+const size_t PIECE_RECV_CHUNK = 64 * 1024;
+
+// bytes of one piece received so far and the running hash over exactly those. When a connection
+// breaks halfway through a piece both are kept, and the next seeder is only asked for the rest
+struct PieceProgress {
+    uint64_t received = 0;
+    SHA256_CTX sha;
+
+    PieceProgress() { SHA256_Init(&sha); }
+    Digest finish() {
+        Digest digest;
+        SHA256_Final(digest.data(), &sha);
+        return digest;
+    }
+};
+
+// seconds a seeder waits on a stalled peer connection (a response it does not read, a request
+// left half sent) before closing it
+const int PEER_IDLE_TIMEOUT_SEC = 60;
+// seconds a downloader waits on a silent seeder before it gives the connection up
+const int PEER_RECV_TIMEOUT_SEC = 30;
+
+void encode_frame_header(const PieceFrameHeader& header, char* out);
+PieceFrameHeader decode_frame_header(const char* in);
+
+bool send_all(int sock, const char* data, size_t len, int flags = 0);
+bool recv_all(int sock, char* data, size_t len);
+
+int connect_with_timeout(const string& ip, int port, int timeout_sec);
+
+enum class PieceResult { RECEIVED, REJECTED, CANCELLED, BROKEN };
+
+// one open connection to a seeder, requests may be pipelined and are answered in order
+class PeerSession {
+private:
+    string seeder;
+    int sock;
+
+public:
+    PeerSession(const string& seeder, int sock);
+    ~PeerSession();
+    PeerSession(const PeerSession&) = delete;
+    PeerSession& operator=(const PeerSession&) = delete;
+
+    const string& name() const { return seeder; }
+    bool request_piece(const string& file_path, int piece_index, uint64_t piece_size);
+    bool request_block(const string& file_path, int piece_index, uint64_t offset, uint64_t length, uint64_t piece_size);
+    bool cancel_piece(const string& file_path, int piece_index);
+    bool request_bitfield(const string& file_path, uint64_t piece_size);
+    // REJECTED when the seeder does not have the file at all
+    PieceResult receive_bitfield(size_t total_pieces, Bitfield& bits);
+    // frame header of the next piece or block; RECEIVED means its `expected_size` bytes follow and
+    // must be read with receive_piece_data. `header_time` (optional) is set when the header arrives,
+    // for RTT/bandwidth estimates
+    PieceResult receive_piece_header(int piece_index, uint64_t expected_size,
+                                     chrono::steady_clock::time_point* header_time = nullptr);
+    // the rest of a piece of `length` bytes, from `progress.received` on, into a pooled buffer or
+    // straight into a mapped destination. Every chunk is hashed as it arrives unless `hash` is
+    // false; on a broken connection `progress` still describes the bytes that did arrive
+    bool receive_piece_data(char* piece, uint64_t length, PieceProgress& progress, bool hash = true);
+};
+
+#endif
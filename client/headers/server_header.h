@@ -0,0 +1,107 @@
+#pragma once
+#ifndef SERVER_HEADER_H
+#define SERVER_HEADER_H
+
+#include <bits/stdc++.h>
+#include <string>
+#include <thread>
+#include <atomic>
+#include "./peer_header.h"
+#include "./uring_header.h"
+#include "./disk_header.h"
+using namespace std;
+
+// ------------------------------------------------------- PEER SERVER -------------------------------------------------------
+// Serves get_piece and get_bitfield requests on the client's peer port with a fixed set of event loop threads.
+// Every loop has its own epoll instance and watches the shared non-blocking listening socket
+// (EPOLLEXCLUSIVE, so one loop wakes per new connection); a connection stays on the loop that
+// accepted it, so its state is never shared between threads. Sockets are non-blocking: a piece
+// that does not fit into the socket buffer is continued on EPOLLOUT instead of parking a thread.
+// With P2P_IO_URING=1 the read/send copy path reads pieces through a per-loop io_uring instead of
+// pread64; sendfile64 stays the default and needs no reads at all.
+
+// longest request line a leecher may send, and how many unparsed request bytes a connection may queue
+const size_t PEER_MAX_REQUEST_LINE = 4096;
+const size_t PEER_MAX_PENDING_INPUT = 1024 * 1024;
+// bytes one connection may write per wakeup before the loop moves on to the others
+const uint64_t PEER_WRITE_BUDGET = 4ULL * 1024 * 1024;
+// copy path buffers a loop registers with its io_uring (P2P_IO_URING=1), one read in flight per buffer
+const unsigned PEER_RING_BUFFERS = 16;
+
+// one leecher connection, owned by the loop that accepted it
+struct PeerConnection {
+    int sock = -1;
+    string in;                                  // request bytes not parsed yet
+    chrono::steady_clock::time_point last_activity;
+    bool watching_out = false;
+
+    // response being written: frame header first, then `remaining` bytes of the piece from `file_fd`
+    bool responding = false;
+    char header[PIECE_FRAME_HEADER_SIZE];
+    size_t header_sent = 0;
+    shared_ptr<OpenFile> file;                  // from the fd cache, keeps file_fd open while the piece is sent
+    int file_fd = -1;
+    off64_t offset = 0;
+    uint64_t remaining = 0;
+    bool zero_copy = true;
+    string body;                                // frames built in memory (get_bitfield) instead of read from `file`
+
+    // copy path when sendfile64 is off or not supported: bytes read from the file but not sent yet
+    vector<char> buffer;
+    size_t buffer_pos = 0;
+    size_t buffer_len = 0;
+    // with io_uring the copy path reads into a registered buffer of the loop instead of `buffer`
+    int ring_buffer = -1;
+    bool read_pending = false;
+};
+
+class PeerServer {
+private:
+    struct Loop {
+        int epoll_fd = -1;
+        thread worker;
+        unordered_map<int, unique_ptr<PeerConnection>> connections;
+
+        // io_uring for copy path reads, completions are signalled on ring_event_fd inside the epoll set
+        IoUring ring;
+        int ring_event_fd = -1;
+        bool buffers_registered = false;
+        vector<char> ring_memory;
+        vector<int> free_buffers;
+        unordered_map<int, int> pending_reads;      // ring buffer -> socket waiting for it, -1 once closed
+        bool ring_unsubmitted = false;
+    };
+
+    int listen_fd;
+    vector<unique_ptr<Loop>> loops;
+    atomic<bool> stopping{false};
+
+    void run(Loop& loop);
+    void accept_connections(Loop& loop);
+    void on_event(Loop& loop, PeerConnection& conn, uint32_t events);
+    bool read_requests(PeerConnection& conn);
+    bool make_progress(Loop& loop, PeerConnection& conn);
+    bool start_response(PeerConnection& conn, const string& request);
+    void start_bitfield_response(PeerConnection& conn, const string& file_path, uint64_t piece_size);
+    bool write_response(Loop& loop, PeerConnection& conn, uint64_t& budget, bool& blocked);
+    void finish_response(Loop& loop, PeerConnection& conn);
+    void setup_ring(Loop& loop);
+    char* copy_buffer(Loop& loop, PeerConnection& conn);
+    bool start_ring_read(Loop& loop, PeerConnection& conn, size_t chunk);
+    void on_ring_completions(Loop& loop);
+    void watch_out(Loop& loop, PeerConnection& conn, bool enable);
+    void close_connection(Loop& loop, int sock);
+    void sweep_idle(Loop& loop);
+
+public:
+    PeerServer(int listen_fd, size_t loop_count);
+    ~PeerServer();
+    PeerServer(const PeerServer&) = delete;
+    PeerServer& operator=(const PeerServer&) = delete;
+
+    bool start();
+    // loops notice within a second, stop() joins them
+    void stop();
+};
+
+#endif
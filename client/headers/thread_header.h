@@ -3,27 +3,65 @@
 #define THREAD_HEADER_H
 
 #include <vector>
+#include <deque>
 #include <thread>
 #include <functional>
+#include <future>
+#include <memory>
+#include <atomic>
 #include <mutex>
 #include <condition_variable>
+#include <type_traits>
 
 using namespace std;
 
 extern const int MAX_THREADS;
-extern vector<thread> thread_pool;
-extern vector<bool> thread_available;
-extern mutex thread_mutex;
-extern condition_variable thread_cv;
 
-bool is_any_thread_available();
+// ------------------------------------------------------- EXECUTOR -------------------------------------------------------
+// Persistent worker threads, each with its own task deque. A worker pops its own deque from the
+// back and, when that is empty, steals from the front of the others. Tasks submitted from inside
+// a worker stay on that worker's deque; tasks from outside are spread round-robin.
+class Executor {
+private:
+    struct WorkQueue {
+        deque<function<void()>> tasks;
+        mutex m;
+    };
 
-int get_available_thread();
+    vector<unique_ptr<WorkQueue>> queues;
+    vector<thread> workers;
+    mutex idle_mutex;
+    condition_variable idle_cv;
+    atomic<size_t> queued{0};
+    atomic<size_t> next_queue{0};
+    atomic<bool> stopping{false};
 
-void release_thread(int idx);
+    void push(function<void()> task);
+    bool pop_or_steal(size_t self, function<void()>& task);
+    void worker_loop(size_t self);
 
-void join_all_threads();
+public:
+    explicit Executor(size_t worker_count);
+    ~Executor();
+    Executor(const Executor&) = delete;
+    Executor& operator=(const Executor&) = delete;
 
-void clear_thread_pool();
+    template <class F>
+    auto submit(F&& f) -> future<invoke_result_t<decay_t<F>>> {
+        using R = invoke_result_t<decay_t<F>>;
+        auto task = make_shared<packaged_task<R()>>(forward<F>(f));
+        future<R> result = task->get_future();
+        push([task]() { (*task)(); });
+        return result;
+    }
 
-#endif
\ No newline at end of file
+    // stop taking work: idle workers exit, busy ones after their current task. does not wait for
+    // them, so a task blocked in I/O never holds up the caller; the destructor joins
+    void shutdown();
+    size_t size() const { return workers.size(); }
+};
+
+// process-wide executor with MAX_THREADS workers
+Executor& executor();
+
+#endif
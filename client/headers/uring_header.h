@@ -0,0 +1,81 @@
+#pragma once
+#ifndef URING_HEADER_H
+#define URING_HEADER_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <sys/uio.h>
+using namespace std;
+
+// ------------------------------------------------------- IO_URING -------------------------------------------------------
+// Minimal io_uring ring on top of the raw syscalls (no liburing needed). Built in with
+// `make IO_URING=1` (default), which defines P2P_WITH_IO_URING; without it init() always
+// fails and callers stay on their plain syscall path. Not thread safe, the owner serializes
+// submissions, and only one thread may consume completions.
+
+struct UringCompletion {
+    uint64_t user_data;
+    int res;                // bytes transferred, or -errno
+};
+
+class IoUring {
+private:
+    int ring_fd = -1;
+    unsigned entries = 0;
+
+    void* sq_ring = nullptr;
+    void* cq_ring = nullptr;
+    size_t sq_ring_size = 0;
+    size_t cq_ring_size = 0;
+    void* sqes = nullptr;
+    size_t sqes_size = 0;
+
+    unsigned* sq_head = nullptr;
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_mask = nullptr;
+    unsigned* sq_array = nullptr;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned* cq_mask = nullptr;
+    void* cqes = nullptr;
+
+    unsigned local_tail = 0;        // SQEs prepared but not yet published to the kernel
+
+    void* next_sqe();
+
+public:
+    IoUring() = default;
+    ~IoUring();
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    bool init(unsigned queue_depth);
+    bool ready() const { return ring_fd >= 0; }
+    unsigned depth() const { return entries; }
+
+    // queue one request, false when the submission queue is full (call submit() first)
+    // `fixed_file`: `fd` is a slot of the registered file table; `buf_index` >= 0 uses a registered buffer
+    bool prep_read(int fd, bool fixed_file, void* buf, unsigned len, uint64_t offset, int buf_index, uint64_t user_data);
+    bool prep_write(int fd, bool fixed_file, const void* buf, unsigned len, uint64_t offset, int buf_index, uint64_t user_data);
+
+    // publish queued requests with one io_uring_enter, optionally waiting for `wait_nr` completions
+    int submit(unsigned wait_nr = 0);
+    // the two halves of submit(): publish() makes queued requests visible (needs the owner's lock),
+    // enter() hands them to the kernel and may run without it, so other threads keep queueing meanwhile
+    unsigned publish();
+    int enter(unsigned to_submit, unsigned wait_nr);
+    // block until at least one completion is available, without submitting anything
+    int wait();
+    // pop the next completion if there is one
+    bool next_completion(UringCompletion& completion);
+
+    bool register_buffers(const vector<iovec>& buffers);
+    // sparse table of `slots` registered files, filled with update_file()
+    bool register_file_table(unsigned slots);
+    bool update_file(unsigned slot, int fd);
+    // the eventfd is signalled on every completion, so an epoll loop can wait for the ring
+    bool register_eventfd(int event_fd);
+};
+
+#endif
@@ -6,6 +6,7 @@
 #include <string>
 #include <netinet/in.h>
 #include <bits/stdc++.h>
+#include "./file_header.h"
 using namespace std;
 
 bool file_validation(const string& filepath);
@@ -26,9 +27,17 @@ void tokenize(const string& str, vector<string>& tokens);
 
 bool validate_file_existence(const string& file_path);
 
-string calculate_SHA(const string& data);
+Digest calculate_SHA(const string& data);
+Digest calculate_SHA(const char* data, size_t len);
 
-string calculate_full_file_SHA(const string& file_path);
+// full file SHA: Merkle root over the piece digests
+Digest calculate_merkle_root(const vector<Digest>& piece_SHA);
+
+// read buffers calculate_file_SHA may hold at once (at least two pieces whatever the piece size)
+const size_t FILE_HASH_BUFFER_BYTES = 64ULL * 1024 * 1024;
+
+// every piece SHA and their Merkle root from a single read of the file, pieces hashed on the executor
+bool calculate_file_SHA(const string& file_path, uint64_t piece_size, Digest& full_SHA, vector<Digest>& piece_SHA);
 
 string generate_file_message(const string& command, const string& username, const string& ip, int port);
 
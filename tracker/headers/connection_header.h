@@ -0,0 +1,101 @@
+#pragma once
+#ifndef CONNECTION_HEADER_H
+#define CONNECTION_HEADER_H
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <deque>
+using namespace std;
+
+class ClientManager;
+
+// ------------------------------------------------------- CONNECTION -------------------------------------------------------
+// One non-blocking socket registered in the tracker's epoll set. The event loop only moves bytes:
+// it appends whatever arrives to `in` and cuts complete messages out of it according to the current
+// framing. Messages of one connection are handled one at a time on the executor, so the handler may
+// switch the framing for the next message (e.g. upload_file -> length prefixed file data).
+//
+//     LINE             command ending with '\n'              (client commands, first hello line)
+//     LENGTH_PREFIXED  8 byte network order length + data    (upload_file_data)
+//     RAW              exactly `raw_length` bytes            (SYNC_SIZE body from another tracker)
+
+const size_t MAX_LINE_SIZE = 64 * 1024;
+const size_t MAX_FRAME_SIZE = 256ULL * 1024 * 1024;
+// reply bytes produced ahead of what the peer has read while a stream is being sent
+const size_t METADATA_STREAM_BACKLOG = 1024 * 1024;
+
+class Connection {
+public:
+    enum class Framing { LINE, LENGTH_PREFIXED, RAW };
+    // a reply produced piece by piece: fills `data` with the next part, false once nothing is left
+    using StreamSource = function<bool(string& data)>;
+
+    // set by the handler running on the executor, read only by it
+    shared_ptr<ClientManager> client_manager;
+    bool sync_peer = false;
+
+    Connection(int fd, int epoll_fd, const string& peer_ip, int peer_port);
+
+    int fd() const { return sock; }
+    const string& peer_ip() const { return ip; }
+    int peer_port() const { return port; }
+
+    // event loop side: read everything the socket has, false once the peer closed or failed
+    bool read_available();
+    // event loop side: push queued replies on EPOLLOUT
+    void flush();
+
+    enum class Step { MESSAGE, RELEASED, FINISHED };
+
+    // true when a worker should be started for this connection (a message or a close is pending
+    // and no worker is on it yet), the worker then owns the connection until next_step() says otherwise
+    bool claim();
+    // worker side: MESSAGE fills `message` with the next complete message, RELEASED hands the
+    // connection back to the event loop, FINISHED means peer gone or close requested and the worker
+    // must tear the connection down
+    Step next_step(string& message);
+
+    void expect_line();
+    void expect_length_prefixed();
+    void expect_bytes(size_t length);
+
+    // queue data for the peer, writes what the socket takes now and leaves the rest to EPOLLOUT
+    bool send_message(const string& data);
+    // queue a reply produced by `source` behind the queued ones. The event loop tops the queue up from
+    // it on EPOLLOUT while less than METADATA_STREAM_BACKLOG is queued, so no worker waits for a slow
+    // reader; messages sent before the stream ends follow it
+    bool send_stream(StreamSource source);
+    void request_close();
+
+    // unregister from epoll, the caller closes the fd after removing it from the connection table
+    void detach();
+
+private:
+    int sock;
+    int epoll_fd;
+    string ip;
+    int port;
+
+    mutex m;
+    string in;
+    string out;
+    deque<StreamSource> pending;    // streams being sent, and replies queued behind them, in order
+    Framing framing = Framing::LINE;
+    size_t raw_length = 0;
+    bool busy = false;
+    bool peer_closed = false;
+    bool close_requested = false;
+    bool registered = true;
+    bool watching_out = false;
+
+    bool has_message_locked() const;
+    bool oversized_locked() const;
+    void take_message_locked(string& message);
+    void refill_locked();
+    bool write_out_locked();
+    void watch_out_locked(bool enable);
+};
+
+#endif
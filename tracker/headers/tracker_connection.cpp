@@ -0,0 +1,216 @@
+#include "./connection_header.h"
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+
+using namespace std;
+
+// 8 byte network order length in front of LENGTH_PREFIXED messages
+static uint64_t read_length_prefix(const string& data) {
+    uint64_t length = 0;
+    for (int i = 0; i < 8; ++i) {
+        length = (length << 8) | (unsigned char)data[i];
+    }
+    return length;
+}
+
+Connection::Connection(int fd, int epoll_fd, const string& peer_ip, int peer_port)
+    : sock(fd), epoll_fd(epoll_fd), ip(peer_ip), port(peer_port) {}
+
+//-------------------------------------------------------Framing----------------------------------------------------------//
+
+bool Connection::has_message_locked() const {
+    switch (framing) {
+        case Framing::LINE:
+            return in.find('\n') != string::npos;
+        case Framing::LENGTH_PREFIXED:
+            return in.size() >= 8 && in.size() - 8 >= read_length_prefix(in);
+        case Framing::RAW:
+            return in.size() >= raw_length;
+    }
+    return false;
+}
+
+// a peer that keeps sending without ever completing a message is dropped
+bool Connection::oversized_locked() const {
+    if (framing == Framing::LINE) {
+        return in.size() > MAX_LINE_SIZE && in.find('\n') == string::npos;
+    }
+    if (framing == Framing::LENGTH_PREFIXED && in.size() >= 8) {
+        return read_length_prefix(in) > MAX_FRAME_SIZE;
+    }
+    return false;
+}
+
+void Connection::take_message_locked(string& message) {
+    switch (framing) {
+        case Framing::LINE: {
+            size_t end = in.find('\n');
+            message.assign(in, 0, end + 1);
+            in.erase(0, end + 1);
+            break;
+        }
+        case Framing::LENGTH_PREFIXED: {
+            size_t length = read_length_prefix(in);
+            message.assign(in, 8, length);
+            in.erase(0, 8 + length);
+            break;
+        }
+        case Framing::RAW:
+            message.assign(in, 0, raw_length);
+            in.erase(0, raw_length);
+            break;
+    }
+}
+
+void Connection::expect_line() {
+    lock_guard<mutex> lock(m);
+    framing = Framing::LINE;
+}
+
+void Connection::expect_length_prefixed() {
+    lock_guard<mutex> lock(m);
+    framing = Framing::LENGTH_PREFIXED;
+}
+
+void Connection::expect_bytes(size_t length) {
+    lock_guard<mutex> lock(m);
+    framing = Framing::RAW;
+    raw_length = length;
+}
+
+//-------------------------------------------------------Event Loop Side----------------------------------------------------------//
+
+bool Connection::read_available() {
+    char buffer[64 * 1024];
+    lock_guard<mutex> lock(m);
+
+    while (!peer_closed) {
+        ssize_t n = recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (n > 0) {
+            in.append(buffer, n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        peer_closed = true;
+    }
+
+    if (!peer_closed && oversized_locked()) {
+        peer_closed = true;
+    }
+    // nothing more to read, stop level triggered EPOLLIN/EPOLLHUP from firing until the worker tears it down
+    if (peer_closed && registered) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sock, nullptr);
+        registered = false;
+    }
+    return !peer_closed;
+}
+
+void Connection::flush() {
+    lock_guard<mutex> lock(m);
+    write_out_locked();
+    if (out.empty()) watch_out_locked(false);
+}
+
+bool Connection::claim() {
+    lock_guard<mutex> lock(m);
+    if (busy) return false;
+    if (!peer_closed && !close_requested && !has_message_locked()) return false;
+    busy = true;
+    return true;
+}
+
+//-------------------------------------------------------Worker Side----------------------------------------------------------//
+
+Connection::Step Connection::next_step(string& message) {
+    lock_guard<mutex> lock(m);
+    if (close_requested) return Step::FINISHED;
+    // buffered messages still run after the peer closed, a SYNC body usually arrives together with the FIN
+    if (has_message_locked()) {
+        take_message_locked(message);
+        return Step::MESSAGE;
+    }
+    if (peer_closed) return Step::FINISHED;
+    busy = false;
+    return Step::RELEASED;
+}
+
+// top `out` up from the pending streams, each one to its end before whatever was queued behind it
+void Connection::refill_locked() {
+    while (!pending.empty() && out.size() < METADATA_STREAM_BACKLOG) {
+        string data;
+        if (pending.front()(data)) out += data;
+        else pending.pop_front();
+    }
+}
+
+bool Connection::write_out_locked() {
+    refill_locked();
+    while (!out.empty()) {
+        ssize_t n = send(sock, out.data(), out.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n > 0) {
+            out.erase(0, n);
+            refill_locked();
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+        peer_closed = true;
+        out.clear();
+        pending.clear();
+        return false;
+    }
+    return true;
+}
+
+void Connection::watch_out_locked(bool enable) {
+    if (!registered || watching_out == enable) return;
+    struct epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLRDHUP | (enable ? EPOLLOUT : 0);
+    ev.data.fd = sock;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, sock, &ev) == 0) {
+        watching_out = enable;
+    }
+}
+
+bool Connection::send_message(const string& data) {
+    lock_guard<mutex> lock(m);
+    if (peer_closed) return false;
+    if (pending.empty()) {
+        out += data;
+    } else {
+        pending.push_back([data, sent = false](string& next) mutable {
+            if (sent) return false;
+            next = data;
+            sent = true;
+            return true;
+        });
+    }
+    if (!write_out_locked()) return false;
+    if (!out.empty()) watch_out_locked(true);
+    return true;
+}
+
+bool Connection::send_stream(StreamSource source) {
+    lock_guard<mutex> lock(m);
+    if (peer_closed) return false;
+    pending.push_back(move(source));
+    if (!write_out_locked()) return false;
+    if (!out.empty()) watch_out_locked(true);
+    return true;
+}
+
+void Connection::request_close() {
+    lock_guard<mutex> lock(m);
+    close_requested = true;
+}
+
+void Connection::detach() {
+    lock_guard<mutex> lock(m);
+    if (registered) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sock, nullptr);
+        registered = false;
+    }
+}
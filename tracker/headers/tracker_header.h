@@ -14,6 +14,7 @@ class UserManager;
 class GroupManager;
 class FileManager;
 class CommandManager;
+class Connection;
 
 class Tracker {
 private:
@@ -29,12 +30,18 @@ private:
     shared_ptr<CommandManager> command_manager;
     vector<Address> other_trackers;
     mutex sync_mutex;
+    int epoll_fd;
+    unordered_map<int, shared_ptr<Connection>> connections;
+    mutex connections_mutex;
 
 
     bool set_tracker_address();
     bool start_as_server();
-    void handle_client(int client_sock);
-    void assign_task_to_thread(int client_socket);
+    void accept_connections();
+    void on_connection_event(int fd, uint32_t events);
+    void serve_connection(shared_ptr<Connection> conn);
+    bool handle_message(Connection& conn, const string& message);
+    void close_connection(shared_ptr<Connection> conn);
     void init_sync();
     void send_sync_message(const Address& address, const string& message,int& updated_count );
     void input_listener();
@@ -1,8 +1,10 @@
 #include "./tracker_header.h"
 #include "./thread_header.h"
 #include "./utils_header.h"
+#include "./connection_header.h"
 
 #include <sys/stat.h>
+#include <sys/epoll.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <thread>
@@ -20,10 +22,7 @@ Tracker::Tracker(const string& tracker,const int id) {
     tracker_ip = "";
     tracker_port = -1;
     tracker_sock = -1;
-
-
-    thread_pool.resize(MAX_THREADS);
-    thread_available.assign(MAX_THREADS, true);
+    epoll_fd = -1;
 
     // make shared varible which same for accrosee all client threds
     um = make_shared<UserManager>();
@@ -166,96 +165,144 @@ void Tracker::send_sync_message(const Address& address, const string& message,in
 //-------------------------------------------------------Tracker Send Responce----------------------------------------------------------//
 
 
-void Tracker::handle_client(int client_socket) {
+// first message of a connection tells who is on the other side: SYNC_SIZE from another tracker,
+// otherwise the "ip port" a client listens on. after that every message goes to its ClientManager
+bool Tracker::handle_message(Connection& conn, const string& message) {
 
-    char buffer[1024];
-    memset(buffer, 0, sizeof(buffer));
+    //identify it is SYNC message form other traker then direclt go to command manager not need to make client manager
+    if (conn.sync_peer) {
+        command_manager->sync_handler(message);
+        return false;
+    }
 
-    int bytes = recv(client_socket, buffer, sizeof(buffer)-1, 0);
-    string client_info="";
-    if (bytes > 0) {
-        buffer[bytes] = '\0';
-        client_info = buffer;
+    if (conn.client_manager) {
+        return conn.client_manager->handle_message(message);
     }
 
     vector<string> tokens;
-    tokenize(client_info, tokens); 
-    
-    
-    //identify it is SYNC message form other traker then direclt go to command manager not need to make client manager 
-        
+    tokenize(message, tokens);
+
     if (!tokens.empty() && tokens[0] == "SYNC_SIZE") {
-        string reply = "ACK\n";
-        send(client_socket, reply.c_str(), reply.size(), 0);
-        
-        size_t msg_len = std::stoull(tokens[1]);
-       
-        vector<char> full_message(msg_len);
-        size_t total_received = 0;
-
-        while (total_received < msg_len) {
-            ssize_t n = recv(client_socket,
-                            full_message.data() + total_received,
-                            msg_len - total_received,
-                            0);
-            if (n <= 0) {
-                cerr << "Connection closed or recv error\n";
-                close(client_socket);
-                return;
-            }
-            total_received += n;
+        if (tokens.size() < 2) return false;
+        char* end = nullptr;
+        unsigned long long msg_len = strtoull(tokens[1].c_str(), &end, 10);
+        if (*end != '\0' || msg_len > MAX_FRAME_SIZE) {
+            logger->log("Invalid SYNC_SIZE from " + conn.peer_ip(), tracker_ip, tracker_port, "ERROR", true);
+            return false;
         }
-
-       
-        string sync_mess(full_message.data(), total_received);
-        
-        command_manager->sync_handler(sync_mess);
-        
+        conn.sync_peer = true;
+        conn.expect_bytes(msg_len);
+        conn.send_message("ACK\n");
+        return true;
     }
+
     // this is firts messge form cline t whihc send IP PORT formate mesage to infor tracker this address it listening address if any one other want to connect
-    else{
-        string ip = tokens[0];
-        string port_str = tokens[1];
-        int port = stoi(tokens[1]);
-        logger->log("New Client Connected",ip,port,"INFO",true);
-        ClientManager* cm = new ClientManager(this,um.get(), gm.get(),fm.get(),logger.get(),  command_manager.get(),  client_socket, ip, port);
-        cm->start_communication();
-        return ;
-        
+    if (tokens.size() < 2 || !ip_address_validation(tokens[0], atoi(tokens[1].c_str()))) {
+        logger->log("Invalid client address message from " + conn.peer_ip(), tracker_ip, tracker_port, "ERROR", true);
+        return false;
     }
+    string ip = tokens[0];
+    int port = atoi(tokens[1].c_str());
+    logger->log("New Client Connected",ip,port,"INFO",true);
+    conn.client_manager = make_shared<ClientManager>(this, um.get(), gm.get(), fm.get(), logger.get(), command_manager.get(), &conn, ip, port);
+    return true;
+}
 
+// runs on the executor, handles the buffered messages of one connection in order and then gives it back to the event loop
+void Tracker::serve_connection(shared_ptr<Connection> conn) {
+    string message;
+    while (true) {
+        Connection::Step step = conn->next_step(message);
+        if (step == Connection::Step::RELEASED) return;
+        if (step == Connection::Step::FINISHED) {
+            close_connection(conn);
+            return;
+        }
 
-    
+        bool keep_open = false;
+        try {
+            keep_open = handle_message(*conn, message);
+        } catch (const exception& ex) {
+            logger->log(string("Exception while handling message: ") + ex.what(), conn->peer_ip(), conn->peer_port(), "ERROR", true);
+        }
+        if (!keep_open) conn->request_close();
+    }
+}
+
+void Tracker::close_connection(shared_ptr<Connection> conn) {
+    if (conn->client_manager) {
+        conn->client_manager->on_disconnect();
+    }
+    conn->detach();
+    {
+        lock_guard<mutex> lock(connections_mutex);
+        connections.erase(conn->fd());
+    }
+    // close only after the fd left the table, accept may hand out the same number right away
+    close(conn->fd());
 }
 
-// this furnion avible thread form thread pool and assign task
-void Tracker::assign_task_to_thread(int client_socket) {
-    unique_lock<mutex> lock(thread_mutex);
-    // Wait until at least one thread is available
-    thread_cv.wait(lock, [] {
-        return is_any_thread_available();
-    });
+void Tracker::on_connection_event(int fd, uint32_t events) {
+    shared_ptr<Connection> conn;
+    {
+        lock_guard<mutex> lock(connections_mutex);
+        auto it = connections.find(fd);
+        if (it == connections.end()) return;
+        conn = it->second;
+    }
+
+    if (events & EPOLLOUT) {
+        conn->flush();
+    }
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        conn->read_available();
+    }
+    if (conn->claim()) {
+        executor().submit([this, conn]() {
+            serve_connection(conn);
+        });
+    }
+}
 
+void Tracker::accept_connections() {
+    while (true) {
+        struct sockaddr_in peer{};
+        socklen_t peer_len = sizeof(peer);
+        int sock = accept4(tracker_sock, (struct sockaddr *)&peer, &peer_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                logger->log("New Request accept failed", tracker_ip, tracker_port, "ERROR", true);
+            }
+            return;
+        }
 
-    // Get available thread index
-    int idx = get_available_thread();
+        char peer_ip[INET_ADDRSTRLEN] = {0};
+        inet_ntop(AF_INET, &peer.sin_addr, peer_ip, sizeof(peer_ip));
+        auto conn = make_shared<Connection>(sock, epoll_fd, peer_ip, ntohs(peer.sin_port));
+        {
+            lock_guard<mutex> lock(connections_mutex);
+            connections[sock] = conn;
+        }
 
-    lock.unlock();
-    
-    
-    // Launch the thread to handle the client
-    thread_pool[idx] = thread([this, idx, client_socket]() {
-        handle_client(client_socket);
-        
-        release_thread(idx);
-    });
-    thread_pool[idx].detach();
-   
+        struct epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.fd = sock;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+            logger->log("Failed to watch new connection", tracker_ip, tracker_port, "ERROR", true);
+            {
+                lock_guard<mutex> lock(connections_mutex);
+                connections.erase(sock);
+            }
+            close(sock);
+        }
+    }
 }
 
-// this start menas here tracker take address accroding id to start form tracker.info 
+// this start menas here tracker take address accroding id to start form tracker.info
+// one thread waits on epoll for every socket, complete messages are handled on the executor
 bool Tracker::start_as_server() {
-    tracker_sock = socket(AF_INET, SOCK_STREAM, 0);
+    tracker_sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (tracker_sock < 0) {
         logger->log("Failed to create socket.",tracker_ip, tracker_port, "ERROR", true);
         return false;
@@ -278,28 +325,48 @@ bool Tracker::start_as_server() {
         return false;
     }
 
-    if (listen(tracker_sock, 3) < 0) {
+    if (listen(tracker_sock, SOMAXCONN) < 0) {
         logger->log("Failed to listen on socket.",tracker_ip, tracker_port, "ERROR", true);
         close(tracker_sock);
         return false;
     }
 
-    socklen_t addrlen = sizeof(address);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        logger->log("Failed to create epoll instance.",tracker_ip, tracker_port, "ERROR", true);
+        close(tracker_sock);
+        return false;
+    }
+
+    struct epoll_event listen_ev{};
+    listen_ev.events = EPOLLIN;
+    listen_ev.data.fd = tracker_sock;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, tracker_sock, &listen_ev) < 0) {
+        logger->log("Failed to watch listening socket.",tracker_ip, tracker_port, "ERROR", true);
+        close(tracker_sock);
+        return false;
+    }
+
     logger->log(("Tracker listening on " + tracker_ip+":"+to_string(tracker_port)+ " other trackers for sync"), tracker_ip, tracker_port,"INFO",true);
-    while (true) {
-        int other_client_sock = accept(tracker_sock, (struct sockaddr *)&address, &addrlen);
-        
-        if (other_client_sock < 0) {
-            
-            logger->log("New Request accept failed", tracker_ip, tracker_port, "ERROR", true);
-            continue;
-        }
 
-        
-        
-        // forward to tradeing part
-        assign_task_to_thread(other_client_sock);
+    const int MAX_EVENTS = 256;
+    struct epoll_event events[MAX_EVENTS];
+    while (running) {
+        // wake up now and then so stop() is noticed
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, 1000);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            logger->log("epoll_wait failed", tracker_ip, tracker_port, "ERROR", true);
+            return false;
+        }
 
+        for (int i = 0; i < n; ++i) {
+            if (events[i].data.fd == tracker_sock) {
+                accept_connections();
+            } else {
+                on_connection_event(events[i].data.fd, events[i].events);
+            }
+        }
     }
 
     return true;
@@ -371,8 +438,7 @@ bool Tracker::start() {
 bool Tracker::stop() {
     running = false;
     close(tracker_sock);
-    clear_thread_pool();
-    join_all_threads();
+    executor().shutdown();
     return true;
 }
 
@@ -382,8 +448,8 @@ Tracker::~Tracker() {
 
     logger->log("Tracker stopped successfully.",tracker_ip, tracker_port, "INFO", true);
     close(tracker_sock);
-    clear_thread_pool();
-    join_all_threads();
+    if (epoll_fd >= 0) close(epoll_fd);
+    executor().shutdown();
     
         
 
@@ -4,56 +4,95 @@
 #include <functional>
 #include <mutex>
 #include <condition_variable>
+#include <algorithm>
 
 using namespace std;
 
+// Dynamically determine thread count based on hardware
 const int MAX_THREADS = max(2u, min(10u, thread::hardware_concurrency()));
-vector<std::thread> thread_pool(MAX_THREADS);
-vector<bool> thread_available(MAX_THREADS, true);
-mutex thread_mutex;
-condition_variable thread_cv;
 
-// Function to check if any thread is available
-bool is_any_thread_available() {
-    for (bool available : thread_available) {
-        if (available) return true;
+// executor and deque index owned by the current thread, -1 outside any executor
+static thread_local const Executor* current_executor = nullptr;
+static thread_local int current_worker = -1;
+
+Executor::Executor(size_t worker_count) {
+    for (size_t i = 0; i < worker_count; ++i) {
+        queues.push_back(make_unique<WorkQueue>());
+    }
+    for (size_t i = 0; i < worker_count; ++i) {
+        workers.emplace_back(&Executor::worker_loop, this, i);
     }
-    return false;
 }
 
-// Function to find an available thread index
-int get_available_thread() {
-    for (int i = 0; i < MAX_THREADS; ++i) {
-        if (thread_available[i]) {
-            thread_available[i] = false;
-            return i;
-        }
+Executor::~Executor() {
+    shutdown();
+    for (thread& worker : workers) {
+        if (worker.joinable()) worker.join();
     }
-    return -1; // No thread available
 }
 
-// Function to mark thread as available
-void release_thread(int idx) {
+void Executor::push(function<void()> task) {
+    size_t target = current_executor == this ? (size_t)current_worker : next_queue++ % queues.size();
     {
-        unique_lock<mutex> lock(thread_mutex);
-        thread_available[idx] = true;
+        lock_guard<mutex> lock(queues[target]->m);
+        queues[target]->tasks.push_back(move(task));
+        queued++;
     }
-    thread_cv.notify_one();
+    // take idle_mutex so a worker about to sleep cannot miss this task
+    { lock_guard<mutex> lock(idle_mutex); }
+    idle_cv.notify_one();
 }
 
+// own deque from the back (most recent, still cache warm), others from the front
+bool Executor::pop_or_steal(size_t self, function<void()>& task) {
+    {
+        WorkQueue& own = *queues[self];
+        lock_guard<mutex> lock(own.m);
+        if (!own.tasks.empty()) {
+            task = move(own.tasks.back());
+            own.tasks.pop_back();
+            queued--;
+            return true;
+        }
+    }
+    for (size_t i = 1; i < queues.size(); ++i) {
+        WorkQueue& victim = *queues[(self + i) % queues.size()];
+        lock_guard<mutex> lock(victim.m);
+        if (!victim.tasks.empty()) {
+            task = move(victim.tasks.front());
+            victim.tasks.pop_front();
+            queued--;
+            return true;
+        }
+    }
+    return false;
+}
 
-// Function to join all threads before exiting
-void join_all_threads() {
-    for (int i = 0; i < MAX_THREADS; ++i) {
-        if (thread_pool[i].joinable()) {
-            thread_pool[i].join();
+void Executor::worker_loop(size_t self) {
+    current_executor = this;
+    current_worker = (int)self;
+    while (!stopping) {
+        function<void()> task;
+        if (pop_or_steal(self, task)) {
+            task();     // packaged_task stores exceptions in the future
+            continue;
         }
+        unique_lock<mutex> lock(idle_mutex);
+        idle_cv.wait(lock, [this] { return stopping || queued > 0; });
+    }
+}
+
+void Executor::shutdown() {
+    {
+        lock_guard<mutex> lock(idle_mutex);
+        if (stopping) return;
+        stopping = true;
     }
+    idle_cv.notify_all();
 }
 
-void clear_thread_pool() {
-    thread_pool.clear();
-    thread_available.clear();
-    thread_pool.resize(MAX_THREADS);
-    thread_available.resize(MAX_THREADS, true);
-}
\ No newline at end of file
+// never destroyed: workers may still sit in blocking I/O when the process exits
+Executor& executor() {
+    static Executor* instance = new Executor(MAX_THREADS);
+    return *instance;
+}
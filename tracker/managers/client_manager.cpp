@@ -1,6 +1,7 @@
 #include "manager.h"
 #include "../headers/utils_header.h"
 #include "../headers/tracker_header.h"
+#include "../headers/connection_header.h"
 #include <sys/stat.h>
 #include <arpa/inet.h>
 #include <string.h>
@@ -12,7 +13,7 @@ using namespace std;
 
 
 static inline uint64_t htonll(uint64_t v) {
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
     return (((uint64_t)htonl((uint32_t)(v & 0xffffffffULL))) << 32) |
            htonl((uint32_t)(v >> 32));
 #else
@@ -20,7 +21,7 @@ static inline uint64_t htonll(uint64_t v) {
 #endif
 }
 static inline uint64_t ntohll(uint64_t v) {
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
     return (((uint64_t)ntohl((uint32_t)(v & 0xffffffffULL))) << 32) |
            ntohl((uint32_t)(v >> 32));
 #else
@@ -28,8 +29,8 @@ static inline uint64_t ntohll(uint64_t v) {
 #endif
 }
 
-ClientManager:: ClientManager(Tracker* tracker, UserManager* um, GroupManager* gm,FileManager* fm, Logger* logger,CommandManager* command_manager,int socket_id, string ip, int port)
-        : tracker(tracker), um(um), gm(gm), fm(fm), logger(logger),command_manager(command_manager),  socket_id(socket_id), ip(ip), port(port), logged_in(false) 
+ClientManager:: ClientManager(Tracker* tracker, UserManager* um, GroupManager* gm,FileManager* fm, Logger* logger,CommandManager* command_manager,Connection* connection, string ip, int port)
+        : tracker(tracker), um(um), gm(gm), fm(fm), logger(logger),command_manager(command_manager),  connection(connection), ip(ip), port(port), logged_in(false) 
     {
         username = "";
         client_address = {ip, port};
@@ -41,132 +42,115 @@ void ClientManager::notify_sync(string message) {
         tracker->start_sync(new_mesage);
 }
 
+// 8 byte network order length + data
+static string length_prefixed(const string& data){
+    uint64_t len_net = htonll(data.size());
+    return string((const char*)&len_net, sizeof(len_net)) + data;
+}
+
+bool ClientManager::send_frame(const string& data){
+    return send_message(length_prefixed(data));
+}
+
 bool ClientManager::send_message(string message){
     if(socket_closed) return false;
-    string reply = message;
-    int sent_bytes = send(socket_id, reply.c_str(), reply.size(), 0);
-    if (sent_bytes == -1) {
+    if (!connection->send_message(message)) {
         logger->log("Error Come during Sending Message", ip, port,"ERROR",true);
         return false;
     }
     return true;
 }
 
-//this loop continue run until use logged in
-bool ClientManager::login_loop(){
-    char buffer[1024];
+// every message of the connection comes here, until login only login/create_user/logout/exit are served
+bool ClientManager::handle_message(const string& raw_message){
+    if (awaiting_file_data) {
+        awaiting_file_data = false;
+        connection->expect_line();
+        return file_data_command(raw_message);
+    }
 
-    
-    while(!logged_in){
-        memset(buffer, 0, sizeof(buffer));
+    // convert trime and tokennize it
+    string message = raw_message;
+    trim_whitespace(message);
+    if(message.empty()) {
+        send_message("Invalid command. Please try again.\n");
+        return true;
+    }
 
-        // user send command to to login and create user, until sucesfully
-        int bytes = recv(socket_id, buffer, sizeof(buffer)-1, 0);
+    //tokenize user message
+    vector<string> tokens;
+    tokenize(message, tokens);
+    if(tokens.empty()) {
+        send_message("Invalid command. Please try again.\n");
+        return true;
+    }
 
-        if(bytes<=0){
-            logger->log("Client unexpected disconnection",ip,port,"FAILED",true);
-            string reply;
-            command_manager->logout_command(reply,username,&client_address,"");
-            notify_sync("logout "+username);
-            if(!socket_closed){
-                close(socket_id);
-                socket_closed = true;
-            }
-            return false;
+    if (!logged_in) return login_command(message, tokens);
+    return session_command(message, tokens);
+}
 
-        }
+//this run until use logged in
+bool ClientManager::login_command(const string& message, const vector<string>& tokens){
+    string reply;
 
-        // convert trime and tokennize it
-        string message="";
-        if (bytes > 0) {
-            buffer[bytes] = '\0';
-            message = buffer;
+    // login token
+    if(tokens[0] == "login") {
+        if(tokens.size() != 3) {
+            send_message("Usage: login <username> <password>\n");
+            return true;
         }
-
-        trim_whitespace(message);
-        if(message.empty()) {
-            send_message("Invalid command. Please try again.\n");
-            continue;
+        username = tokens[1];
+        string password = tokens[2];
+        logged_in=command_manager->login_command(reply,username,password,&client_address,"");
+        if(logged_in){
+            notify_sync(message);
         }
+        send_message(reply);
+        return true;
+    } 
 
-        //tokenize user message
-        vector<string> tokens;
-        string reply;
-        tokenize(message, tokens);
-        if(tokens.empty()) {
-            send_message("Invalid command. Please try again.\n");
-            continue;
+    else if(tokens[0] == "create_user") {
+        if(tokens.size() != 3) {
+            reply="Usage: create_user <username> <password>\n";
+            send_message(reply);
+            return true;
         }
-        
-        // login token
-        if(tokens[0] == "login") {
-            if(tokens.size() != 3) {
-                send_message("Usage: login <username> <password>\n");
-                continue;
-            }
-            username = tokens[1];
-            string password = tokens[2];
-            logged_in=command_manager->login_command(reply,username,password,&client_address,"");
-            if(logged_in){
-                notify_sync(message);
-            }
+        username = tokens[1];
+        string password = tokens[2];
+        if(command_manager->create_user_command(reply,username,password,&client_address,"")){
             send_message(reply);
-            continue;
-
-        } 
-            
-        else if(tokens[0] == "create_user") {
-            if(tokens.size() != 3) {
-                reply="Usage: create_user <username> <password>\n";
-                send_message(reply);
-                continue;
-            }
-            username = tokens[1];
-            string password = tokens[2];
-            if(command_manager->create_user_command(reply,username,password,&client_address,"")){
-                send_message(reply);
-                notify_sync(message);
-            }
-            else{
-                send_message(reply);
-            }
-            continue;
-            
-        }
-
-        else if (tokens[0] == "exit") {
-            logger->log("Client Exited ",ip,port,"INFO",true);
-            string reply;
-            command_manager->logout_command(reply,username,&client_address,"");
-            notify_sync("logout "+username);
-            if(!socket_closed){
-                close(socket_id);
-                socket_closed = true;
-            }
-            return false;
-        }
-
-        else if (tokens[0] == "logout") {
-            if(tokens.size() != 2) {
-                reply="Usage: logout <username>\n";
-                send_message(reply);
-                continue;
-            }
-            username = tokens[1];
-            command_manager->logout_command(reply,username,&client_address,"");
+            notify_sync(message);
+        }
+        else{
             send_message(reply);
-            notify_sync("logout "+username);
-            logged_in=false;
-            continue;
         }
+        return true;
+    }
+
+    else if (tokens[0] == "exit") {
+        logger->log("Client Exited ",ip,port,"INFO",true);
+        command_manager->logout_command(reply,username,&client_address,"");
+        notify_sync("logout "+username);
+        socket_closed = true;
+        return false;
+    }
 
-        else {
-            reply = "Please login/Create first using the login/create_user command.\n";
+    else if (tokens[0] == "logout") {
+        if(tokens.size() != 2) {
+            reply="Usage: logout <username>\n";
             send_message(reply);
+            return true;
         }
-
-        
+        username = tokens[1];
+        command_manager->logout_command(reply,username,&client_address,"");
+        send_message(reply);
+        notify_sync("logout "+username);
+        logged_in=false;
+        return true;
     }
+
+    reply = "Please login/Create first using the login/create_user command.\n";
+    send_message(reply);
     return true;
 }
 
@@ -175,340 +159,288 @@ void ClientManager::init_unexpected_close(){
     logger->log("Client unexpected disconnection",ip,port,"FAILED",true);
     command_manager->logout_command(reply,username,&client_address,"");
     notify_sync("logout "+username);
-    if(!socket_closed){
-        close(socket_id);
-        socket_closed = true;
+    socket_closed = true;
+}
+
+// connection went away, a client that did not say exit is logged out here
+void ClientManager::on_disconnect(){
+    if (!socket_closed) {
+        init_unexpected_close();
     }
 }
 
+// second half of upload_file: the client sends the file meta data after tracker replied send_all_data
+bool ClientManager::file_data_command(string file_info_command){
+    string reply;
+    // upload_file_data <binary file_info>, the binary part must not be trimmed
+    const string prefix = "upload_file_data ";
+    FileInfo finfo;
+    if(file_info_command.compare(0, prefix.size(), prefix) != 0 ||
+       !FileInfo::decode(string_view(file_info_command).substr(prefix.size()), finfo)) {
+        send_message("File data is invalid. Please try again.\n");
+        return true;
+    }
+
+    command_manager->upload_file_data(reply,username,upload_group_id,upload_file_name,finfo,&client_address,"");
+    send_message(reply);
+    notify_sync(file_info_command);
+    return true;
+}
+
 // after login other command mannage
-bool ClientManager::while_loop() {
-    char buffer[1024];
-    
+bool ClientManager::session_command(const string& message, const vector<string>& tokens) {
+    string reply;
 
-    while (true) {
-        memset(buffer, 0, sizeof(buffer));
-        int bytes = recv(socket_id, buffer, sizeof(buffer)-1, 0);
+    if (tokens[0] == "exit") {
+        logger->log("Client Exited ",ip,port,"INFO",true);
+        command_manager->logout_command(reply,username,&client_address,"");
+        notify_sync("logout "+username);
+        socket_closed = true;
+        return false;
+    }
 
-        if (bytes <= 0) {
-            init_unexpected_close();
-            break;
-        }
+    else if(tokens[0]=="logout"){
+        command_manager->logout_command(reply,username,&client_address,"");
+        send_message(reply);
+        notify_sync("logout "+username);
+        logged_in = false;
+        return true;
+    }
 
-        // convert trime and tokennize it
-        string message="";
-        if (bytes > 0) {
-            buffer[bytes] = '\0';
-            message = buffer;
+    else if(tokens[0]=="create_group"){
+        if(tokens.size() != 2) {
+            reply="Usage: create_group <group_id>\n";
+            send_message(reply);
+            return true;
         }
-
-        trim_whitespace(message);
-        if(message.empty()) {
-            send_message("Invalid command. Please try again.\n");
-            continue;
+        string group_id = tokens[1];
+        if(command_manager->create_group_command(reply,username,group_id,&client_address,"")){
+            send_message(reply);
+            notify_sync(message+" "+username);
         }
-
-        //tokenize user message
-        vector<string> tokens;
-        string reply;
-        tokenize(message, tokens);
-        if(tokens.empty()) {
-            send_message("Invalid command. Please try again.\n");
-            continue;
+        else{
+            send_message(reply);
         }
+        return true;
+    }
 
+    else if(tokens[0]=="list_groups"){
+        command_manager->list_group_command(reply,&client_address,"");
+        send_message(reply);
+        return true;
+    }
 
+    else if(tokens[0]=="join_group"){
+        if(tokens.size() != 2) {
+            reply="Usage: join_group <group_id>\n";
+            send_message(reply);
+            return true;
+        }
+        string group_id = tokens[1];
+        if(command_manager->join_group_command(reply,username,group_id,&client_address,"")){
+            send_message(reply);
+            notify_sync(message+" "+username);
+        }
+        else{
+            send_message(reply);
+        }
+        return true;
+    }
 
-        if (tokens[0] == "exit") {
-            logger->log("Client Exited ",ip,port,"INFO",true);
-            string reply;
-            command_manager->logout_command(reply,username,&client_address,"");
-            notify_sync("logout "+username);
-            if(!socket_closed){
-                close(socket_id);
-                socket_closed = true;
-            }
-            break;
+    else if(tokens[0]=="list_requests"){
+        if(tokens.size() != 2) {
+            reply="Usage: list_requests <group_id>\n";
+            send_message(reply);
+            return true;
         }
+        string group_id = tokens[1];
+        command_manager->list_request_command(reply,username,group_id,&client_address,"");
+        send_message(reply);
+        return true;
+    }
 
-        else if(tokens[0]=="logout"){
-            string reply;
-            command_manager->logout_command(reply,username,&client_address,"");
+    else if(tokens[0]=="accept_request"){
+        if(tokens.size() != 3) {
+            reply="Usage: accept_request <group_id> <user_id>\n";
             send_message(reply);
-            notify_sync("logout "+username);
-            if(!login_loop()){
-                if (!socket_closed) {
-                    close(socket_id);
-                    socket_closed = true;
-                }
-                logger->log("Error during logout communication", ip, port, "ERROR", true);
-                return false;
-            }
-            continue;
-
-        }
-
-        else if(tokens[0]=="create_group"){
-            if(tokens.size() != 2) {
-                reply="Usage: create_group <group_id>\n";
-                send_message(reply);
-                continue;
-            }
-            string group_id = tokens[1];
-            string reply;
-            if(command_manager->create_group_command(reply,username,group_id,&client_address,"")){
-                send_message(reply);
-                notify_sync(message+" "+username);
-            }
-            else{
-                send_message(reply);
-            }
-            continue;
-        }
-
-        else if(tokens[0]=="list_groups"){
-            string reply;
-            command_manager->list_group_command(reply,&client_address,"");
+            return true;
+        }
+        string group_id = tokens[1];
+        string requestedname = tokens[2];
+        if(command_manager->accept_request_command(reply,username,requestedname,group_id,&client_address,"")){
             send_message(reply);
-            continue;
-        }
-
-        else if(tokens[0]=="join_group"){
-            if(tokens.size() != 2) {
-                reply="Usage: join_group <group_id>\n";
-                send_message(reply);
-                continue;
-            }
-            string group_id = tokens[1];
-            string reply;
-            if(command_manager->join_group_command(reply,username,group_id,&client_address,"")){
-                send_message(reply);
-                notify_sync(message+" "+username);
-            }
-            else{
-                send_message(reply);
-            }
-            continue;
-        }
-
-        else if(tokens[0]=="list_requests"){
-            if(tokens.size() != 2) {
-                reply="Usage: list_requests <group_id>\n";
-                send_message(reply);
-                continue;
-            }
-            string group_id = tokens[1];
-            string reply;
-            command_manager->list_request_command(reply,username,group_id,&client_address,"");
+            notify_sync(message+" "+username);
+        }
+        else{
             send_message(reply);
-            continue;
-        }
-
-        else if(tokens[0]=="accept_request"){
-            if(tokens.size() != 3) {
-                reply="Usage: accept_request <group_id> <user_id>\n";
-                send_message(reply);
-                continue;
-            }
-            string group_id = tokens[1];
-            string requestedname = tokens[2];
-            string reply;
-            if(command_manager->accept_request_command(reply,username,requestedname,group_id,&client_address,"")){
-                send_message(reply);
-                notify_sync(message+" "+username);
-            }
-            else{
-                send_message(reply);
-            }
-            continue;
-        }
-
-        else if(tokens[0]=="leave_group"){
-            if(tokens.size() != 2) {
-                reply="Usage: leave_group <group_id>\n";
-                send_message(reply);
-                continue;
-            }
-            string group_id = tokens[1];
-            string reply;
-            if(command_manager->leave_group_command(reply,username,group_id,&client_address,"")){
-                send_message(reply);
-                notify_sync(message+" "+username);
-            }
-            else{
-                send_message(reply);
-            }
-            continue;
-
-        }
-
-        else if(tokens[0]=="list_files"){
-            if(tokens.size() != 2) {
-                reply="Usage: list_files <group_id>\n";
-                send_message(reply);
-                continue;
-            }
-            string group_id = tokens[1];
-            string reply;
-            command_manager->list_files_command(reply,username,group_id,&client_address,"");
+        }
+        return true;
+    }
+
+    else if(tokens[0]=="leave_group"){
+        if(tokens.size() != 2) {
+            reply="Usage: leave_group <group_id>\n";
             send_message(reply);
-            continue;
-        }
-
-        else if(tokens[0]=="upload_file"){
-            if(tokens.size() != 3) {
-                reply="Usage: upload_file <group_id> <file_name>\n";
-                send_message(reply);
-                continue;
-            }
-            string group_id = tokens[1];
-            string file_path = tokens[2];
-            string file_name = file_path.substr(file_path.find_last_of("/\\") + 1);
-            string reply;
-
-            if(command_manager->upload_file_command(reply,username,group_id,file_name,&client_address,"")){
-                send_message(reply);
-                //size_accroding max data in File_Info 4048
-                uint64_t msg_len;
-                recv(socket_id, &msg_len, sizeof(msg_len), MSG_WAITALL);
-                msg_len = ntohll(msg_len);
-
-                string buffer(msg_len, '\0');
-                recv(socket_id, &buffer[0], msg_len, MSG_WAITALL);
-
-                string file_info_command = buffer;
-
-                trim_whitespace(file_info_command);
-                if(file_info_command.empty()) {
-                    send_message("File data is empty. Please try again.\n");
-                    continue;
-                }
-
-                 // remove intiaal command and trim it  upload_file_data <file_info>
-                string file_info = file_info_command.substr(file_info_command.find(' ') + 1);
-                trim_whitespace(file_info);
-                if(file_info.empty()) {
-                    send_message("File data is empty. Please try again.\n");
-                    continue;
-                }
-                FileInfo finfo = FileInfo::fromString(file_info);
-
-                command_manager->upload_file_data(reply,username,group_id,file_name,finfo,&client_address,"");
-                send_message(reply);
-                notify_sync(file_info_command);
-            }
-            else{
-                send_message(reply);
-            }
-            continue;
-        }
-
-        else if(tokens[0]=="download_file"){
-            if(tokens.size() != 3) {
-                reply="Usage: download_file <group_id> <file_name>\n";
-                send_message(reply);
-                continue;
-            }
-            string group_id = tokens[1];
-            string file_name = tokens[2];
-            string reply;
-            command_manager->download_file_command(reply,username,group_id,file_name,&client_address,"");
-
-            uint64_t msg_len = reply.size();
-            uint64_t len_net = htonll(msg_len);
-            send(socket_id, &len_net, sizeof(len_net), 0);
+            return true;
+        }
+        string group_id = tokens[1];
+        if(command_manager->leave_group_command(reply,username,group_id,&client_address,"")){
             send_message(reply);
-            continue;
-        }
-
-        else if(tokens[0]=="update_file_info"){
-            cout<<tokens.size()<<endl;
-            for(auto t:tokens) cout<<t<<"--";
-            cout<<endl;
-            if(tokens.size() != 4) {
-                cout<<message<<endl;
-                reply="Usage: update_file_info <group_id> <file_name> <new_file_path>\n";
-                send_message(reply);
-                continue;
-            }
-            string group_id = tokens[1];
-            string file_path = tokens[2];
-            string file_name = file_path.substr(file_path.find_last_of("/\\") + 1);
-            string new_file_path = tokens[3];
-            string reply;
-            if(command_manager->update_file_info(reply,username,group_id,file_name,new_file_path,&client_address,"")){
-                send_message(reply);
-                notify_sync(message+" "+username);
-            }
-            else{
-                send_message(reply);
-            }
-            continue;
-        
+            notify_sync(message+" "+username);
         }
+        else{
+            send_message(reply);
+        }
+        return true;
+    }
 
-        else if(tokens[0]=="stop_share"){
-            if(tokens.size() != 3) {
-                reply="Usage: stop_share <group_id> <file_name>\n";
-                send_message(reply);
-                continue;
-            }
-            string group_id = tokens[1];
-            string file_path = tokens[2];
-            string file_name = file_path.substr(file_path.find_last_of("/\\") + 1);
-            string reply;
-            if(command_manager->stop_share(reply,username,group_id,file_name,&client_address,"")){
-                notify_sync(message+" "+username);
-                send_message(reply);
-            }
-            else{
-                send_message(reply);
-            }
-            
-            continue;
-        }
-
-        else if(tokens[0]=="sync"){
-            // remove intiaal command and trim it <SYNC IP PORT command>
-            size_t pos = message.find("sync");
-            std::string cmd = message.substr(pos + strlen("sync"));
-            trim_whitespace(cmd);
-            if(cmd.empty()) {
-                send_message("Invalid SYNC command. Please try again.\n");
-                continue;
-            }
-            command_manager->sync_handler(cmd);
-            continue;
-        }
-
-        else if(tokens[0]=="login" || tokens[0]=="create_user"){
-            reply="You are already logged in. Please logout first to login/create another user.\n";
+    else if(tokens[0]=="list_files"){
+        if(tokens.size() != 2) {
+            reply="Usage: list_files <group_id>\n";
             send_message(reply);
-            continue;
+            return true;
         }
-        
-        reply="Please, Enter valid command.\n";
+        string group_id = tokens[1];
+        command_manager->list_files_command(reply,username,group_id,&client_address,"");
+        send_message(reply);
+        return true;
+    }
 
+    else if(tokens[0]=="upload_file"){
+        if(tokens.size() != 3) {
+            reply="Usage: upload_file <group_id> <file_name>\n";
+            send_message(reply);
+            return true;
+        }
+        string group_id = tokens[1];
+        string file_path = tokens[2];
+        string file_name = file_path.substr(file_path.find_last_of("/\\") + 1);
+
+        if(command_manager->upload_file_command(reply,username,group_id,file_name,&client_address,"")){
+            // the meta data follows as 8 byte length + upload_file_data <file_info>
+            awaiting_file_data = true;
+            upload_group_id = group_id;
+            upload_file_name = file_name;
+            connection->expect_length_prefixed();
+        }
         send_message(reply);
+        return true;
     }
 
-    return true;
-}
+    else if(tokens[0]=="download_file"){
+        // download_file <group_id> <file_name> [stream]
+        bool stream = tokens.size() == 4 && tokens[3] == "stream";
+        if(tokens.size() != 3 && !stream) {
+            reply="Usage: download_file <group_id> <file_name>\n";
+            send_message(reply);
+            return true;
+        }
+        string group_id = tokens[1];
+        string file_name = tokens[2];
+        vector<Digest> piece_SHA;
+        bool found = command_manager->download_file_command(reply,username,group_id,file_name,&client_address,"",stream ? &piece_SHA : nullptr);
+
+        if (!send_frame(reply)) return true;
+        if (!found || !stream) return true;
+
+        // the digests follow chunk by chunk, encoded by the event loop as the socket takes the previous
+        // ones; this worker is done and the client's next command is served meanwhile
+        bool queued = connection->send_stream([digests = move(piece_SHA), first = (size_t)0](string& data) mutable {
+            if (first >= digests.size()) return false;
+            size_t count = min(METADATA_CHUNK_PIECES, digests.size() - first);
+            data = length_prefixed(encode_piece_chunk(digests, first, count));
+            first += count;
+            return true;
+        });
+        if (!queued) logger->log("Error Come during Sending Message", ip, port,"ERROR",true);
+        return true;
+    }
 
+    else if(tokens[0]=="update_file_info"){
+        cout<<tokens.size()<<endl;
+        for(auto t:tokens) cout<<t<<"--";
+        cout<<endl;
+        if(tokens.size() != 4) {
+            cout<<message<<endl;
+            reply="Usage: update_file_info <group_id> <file_name> <new_file_path>\n";
+            send_message(reply);
+            return true;
+        }
+        string group_id = tokens[1];
+        string file_path = tokens[2];
+        string file_name = file_path.substr(file_path.find_last_of("/\\") + 1);
+        string new_file_path = tokens[3];
+        if(command_manager->update_file_info(reply,username,group_id,file_name,new_file_path,&client_address,"")){
+            send_message(reply);
+            notify_sync(message+" "+username);
+        }
+        else{
+            send_message(reply);
+        }
+        return true;
+    
+    }
 
-void ClientManager::start_communication(){
+    else if(tokens[0]=="stop_share"){
+        // stop_share <group_id> <file_name> [partial]: with `partial` only a partial seeder entry is removed
+        bool partial_only = tokens.size() == 4 && tokens[3] == "partial";
+        if(tokens.size() != 3 && !partial_only) {
+            reply="Usage: stop_share <group_id> <file_name>\n";
+            send_message(reply);
+            return true;
+        }
+        string group_id = tokens[1];
+        string file_path = tokens[2];
+        string file_name = file_path.substr(file_path.find_last_of("/\\") + 1);
+        if(command_manager->stop_share(reply,username,group_id,file_name,&client_address,"",partial_only)){
+            notify_sync(message+" "+username);
+            send_message(reply);
+        }
+        else{
+            send_message(reply);
+        }
+        
+        return true;
+    }
 
-    bool login_flag = login_loop();
+    else if(tokens[0]=="update_pieces"){
+        if(tokens.size() != 5) {
+            reply="Usage: update_pieces <group_id> <file_name> <file_path> <bitfield hex>\n";
+            send_message(reply);
+            return true;
+        }
+        string group_id = tokens[1];
+        string file_name = tokens[2].substr(tokens[2].find_last_of("/\\") + 1);
+        string file_path = tokens[3];
+        string bitfield_hex = tokens[4];
+        if(command_manager->update_pieces(reply,username,group_id,file_name,file_path,bitfield_hex,&client_address,"")){
+            notify_sync(message+" "+username);
+        }
+        send_message(reply);
+        return true;
+    }
 
-    if (!login_flag) {
-        if (!socket_closed) {
-            close(socket_id);
-            socket_closed = true;
+    else if(tokens[0]=="sync"){
+        // remove intiaal command and trim it <SYNC IP PORT command>
+        size_t pos = message.find("sync");
+        std::string cmd = message.substr(pos + strlen("sync"));
+        trim_whitespace(cmd);
+        if(cmd.empty()) {
+            send_message("Invalid SYNC command. Please try again.\n");
+            return true;
         }
-        logger->log("Error during login communication", ip, port, "ERROR", true);
-        return;
+        command_manager->sync_handler(cmd);
+        return true;
     }
 
-    while_loop();
-    return;
-}
\ No newline at end of file
+    else if(tokens[0]=="login" || tokens[0]=="create_user"){
+        reply="You are already logged in. Please logout first to login/create another user.\n";
+        send_message(reply);
+        return true;
+    }
+    
+    reply="Please, Enter valid command.\n";
+
+    send_message(reply);
+    return true;
+}
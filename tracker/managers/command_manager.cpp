@@ -18,12 +18,15 @@ bool CommandManager::sync_handler(string cmd){
     
     vector<string> tokens;
     string reply;
-    tokenize(cmd, tokens);
+    // only the text header is tokenized, an upload_file_data body is binary
+    size_t upload_pos = cmd.find("upload_file_data ");
+    tokenize(upload_pos == string::npos ? cmd : cmd.substr(0, upload_pos + strlen("upload_file_data")), tokens);
     if(tokens.empty()) {
         return false;
     }
 
-    if(tokens.size() < 5 ) {
+    // SYNC IP PORT command [args], upload_file_data has its argument outside the tokens
+    if(tokens.size() < 4 ) {
         return false;
     }
 
@@ -59,6 +62,7 @@ bool CommandManager::sync_handler(string cmd){
     }
 
     else if(tokens[3]=="logout"){
+        if(tokens.size() < 5) return false;
         string username=tokens[4];
         return logout_command(reply,username,&client_address,"SYNC_");
     }
@@ -94,11 +98,14 @@ bool CommandManager::sync_handler(string cmd){
 
     else if(tokens[3]=="upload_file_data"){
 
-        // remove intiaal command and trim it <SYNC IP PORT upload_file_data <file_info>>
-        size_t pos = cmd.find("upload_file_data");
-        std::string file_info = cmd.substr(pos + strlen("upload_file_data"));
-        trim_whitespace(file_info);
-        FileInfo finfo = FileInfo::fromString(file_info);
+        // <SYNC IP PORT upload_file_data <binary file_info>>, the binary part must not be trimmed
+        const string marker = "upload_file_data ";
+        size_t pos = cmd.find(marker);
+        FileInfo finfo;
+        if (pos == string::npos || !FileInfo::decode(string_view(cmd).substr(pos + marker.size()), finfo)) {
+            logger->log("SYNC handler: invalid upload_file_data", ip, port, "ERROR", true);
+            return false;
+        }
         string username=finfo.owner;
         string group_id=finfo.group;
         string file_name=finfo.name;
@@ -121,8 +128,21 @@ bool CommandManager::sync_handler(string cmd){
         string group_id=tokens[4];
         string file_name=tokens[5];
         file_name = file_name.substr(file_name.find_last_of("/\\") + 1);
-        string username=tokens[6];
-        return stop_share(reply,username,group_id,file_name,&client_address,"SYNC_");
+        // stop_share <group_id> <file_name> [partial] <username>
+        bool partial_only = tokens.size() >= 8 && tokens[6] == "partial";
+        string username=tokens[partial_only ? 7 : 6];
+        return stop_share(reply,username,group_id,file_name,&client_address,"SYNC_",partial_only);
+    }
+
+    else if(tokens[3]=="update_pieces"){
+        if(tokens.size() < 9) return false;
+        string group_id=tokens[4];
+        string file_name=tokens[5];
+        file_name = file_name.substr(file_name.find_last_of("/\\") + 1);
+        string file_path=tokens[6];
+        string bitfield_hex=tokens[7];
+        string username=tokens[8];
+        return update_pieces(reply,username,group_id,file_name,file_path,bitfield_hex,&client_address,"SYNC_");
     }
     
     return false;
@@ -475,7 +495,7 @@ map<string, Address> CommandManager::get_available_seeders(map<string, Address>
     return available_seeders;
 }
 
-bool CommandManager::download_file_command(string &reply, string username, string group_id, string filename, Address *client_address, string sync_prefix){
+bool CommandManager::download_file_command(string &reply, string username, string group_id, string filename, Address *client_address, string sync_prefix, vector<Digest>* piece_SHA){
     if(!gm->isGroupAvailabel(group_id)){
         reply = "Group name "+group_id+" is not available.\n";
         string tag = sync_prefix.length() > 0 ? "SYNC" : "INFO";
@@ -509,7 +529,18 @@ bool CommandManager::download_file_command(string &reply, string username, strin
     FileInfo finfo=fm->getFileInfo(group_id,filename);
     finfo.seeder_users=get_available_seeders(finfo.seeder_users);
     finfo.seeder_users.erase(username); // remove self from seeder list if present
-    reply="file_data "+ finfo.toString()+"\n";
+    for (auto it = finfo.seeder_pieces.begin(); it != finfo.seeder_pieces.end();) {
+        if (finfo.seeder_users.count(it->first) == 0) it = finfo.seeder_pieces.erase(it);
+        else ++it;
+    }
+    if(piece_SHA != nullptr) {
+        *piece_SHA = move(finfo.piece_SHA);
+        finfo.piece_SHA.clear();
+        reply="file_data_stream "+ finfo.encode();
+    }
+    else {
+        reply="file_data "+ finfo.encode();
+    }
     
     string tag = sync_prefix.length() > 0 ? "SYNC" : "INFO";
     logger->log(sync_prefix + "File " + filename + " is sended to download in group "+group_id+" by "+username, client_address->ip, client_address->port,tag, true);
@@ -551,7 +582,7 @@ bool CommandManager::update_file_info(string& reply,string username,string group
 
 }
 
-bool CommandManager::stop_share(string& reply,string username,string group_id,string filename,Address* client_address,string  sync_prefix=""){
+bool CommandManager::stop_share(string& reply,string username,string group_id,string filename,Address* client_address,string  sync_prefix,bool partial_only){
     if(!gm->isGroupAvailabel(group_id)){
         reply = "Group name "+group_id+" is not available.\n";
         string tag = sync_prefix.length() > 0 ? "SYNC" : "INFO";
@@ -573,14 +604,64 @@ bool CommandManager::stop_share(string& reply,string username,string group_id,st
         return false;
     }
 
-    if(fm->remove_seeder(username,group_id,filename)){
+    if(fm->remove_seeder(username,group_id,filename,partial_only)){
         reply = "You are successfully stopped sharing file name "+filename+" in group "+group_id+" .\n";
         string tag = sync_prefix.length() > 0 ? "SYNC" : "INFO";
         logger->log(sync_prefix + "File " + filename + " sharing is stopped in group "+group_id+" by "+username, client_address->ip, client_address->port,tag, true);
         return true;
     }
+    // a failed download withdraws only its partial entry, never a complete copy shared before
+    if(partial_only){
+        reply = "File name "+filename+" stays shared in group "+group_id+" because you are not a partial seeder of it.\n";
+        string tag = sync_prefix.length() > 0 ? "SYNC" : "INFO";
+        logger->log(sync_prefix + "File " + filename + " partial sharing is not stopped in group "+group_id+" by "+username+" because he is not a partial seeder", client_address->ip, client_address->port,tag, true);
+        return false;
+    }
     reply = "Failed to stop sharing file name "+filename+" in group "+group_id+" because of unknown error.\n";
     string tag = sync_prefix.length() > 0 ? "SYNC" : "INFO";
     logger->log(sync_prefix + "File " + filename + " sharing is not stopped in group "+group_id+" by "+username, client_address->ip, client_address->port,tag, true);
     return false;
 }
+
+bool CommandManager::update_pieces(string& reply,string username,string group_id,string filename,string file_path,string bitfield_hex,Address* client_address,string  sync_prefix=""){
+    if(!gm->isGroupAvailabel(group_id)){
+        reply = "Group name "+group_id+" is not available.\n";
+        string tag = sync_prefix.length() > 0 ? "SYNC" : "INFO";
+        logger->log(sync_prefix + "Group " + group_id + " try to update pieces by "+username, client_address->ip, client_address->port,tag, true);
+        return false;
+    }
+
+    if(!gm->isMemberOfGroup(username,group_id) && !gm->isGroupOwner(username,group_id)){
+        reply = "You are not member of Group name is "+group_id+" .\n";
+        string tag = sync_prefix.length() > 0 ? "SYNC" : "INFO";
+        logger->log(sync_prefix + "Group " + group_id + " try to update pieces by "+username+" but he is not member", client_address->ip, client_address->port,tag, true);
+        return false;
+    }
+
+    if(!fm->isFileExist(group_id,filename)){
+        reply = "File name "+filename+" is not exist in group "+group_id+" .\n";
+        string tag = sync_prefix.length() > 0 ? "SYNC" : "INFO";
+        logger->log(sync_prefix + "File " + filename + " try to update pieces in group "+group_id+" by "+username+" but file is not exist", client_address->ip, client_address->port,tag, true);
+        return false;
+    }
+
+    Bitfield bits;
+    bool full_seeder = false;
+    if(hex_to_bitfield(bitfield_hex,bits) && fm->update_seeder_pieces(group_id,filename,username,*client_address,file_path,bits,full_seeder)){
+        // nothing changed, the reply must not read as a partial seeder registration
+        if(full_seeder){
+            reply = "File name "+filename+" is already shared completely by you in group "+group_id+" .\n";
+            string tag = sync_prefix.length() > 0 ? "SYNC" : "INFO";
+            logger->log(sync_prefix + "File " + filename + " pieces are not updated in group "+group_id+" by "+username+" because he shares the whole file", client_address->ip, client_address->port,tag, true);
+            return false;
+        }
+        reply = "Pieces of file name "+filename+" are successfully updated in group "+group_id+" .\n";
+        string tag = sync_prefix.length() > 0 ? "SYNC" : "INFO";
+        logger->log(sync_prefix + "File " + filename + " pieces are updated in group "+group_id+" by "+username, client_address->ip, client_address->port,tag, true);
+        return true;
+    }
+    reply = "Failed pieces of file name "+filename+" are not updated in group "+group_id+" because the bitfield is invalid.\n";
+    string tag = sync_prefix.length() > 0 ? "SYNC" : "INFO";
+    logger->log(sync_prefix + "File " + filename + " pieces are not updated in group "+group_id+" by "+username, client_address->ip, client_address->port,tag, true);
+    return false;
+}
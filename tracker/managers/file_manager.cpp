@@ -49,6 +49,7 @@ bool FileManager::add_new_seeder(const string& group,const string& filename,cons
     if (group_files.count(group) > 0 && group_files[group].count(filename) > 0) {
         group_files[group][filename].seeder_users[username] = addr;
         group_files[group][filename].user_file_map[username] = new_file_path;
+        group_files[group][filename].seeder_pieces.erase(username);     // holds every piece now
 
         for (auto& [user, addr] : group_files[group][filename].seeder_users) {
             cout<<"Seeder: " << user << " at " << addr.ip << ":" << addr.port << endl;
@@ -60,16 +61,20 @@ bool FileManager::add_new_seeder(const string& group,const string& filename,cons
     return false;
 }
 
-bool FileManager::remove_seeder(const string& username,const string& group,const string& filename) {
+bool FileManager::remove_seeder(const string& username,const string& group,const string& filename,bool partial_only) {
     lock_guard<mutex> lock(file_mtx);
 
     if (group_files.count(group) > 0 && group_files[group].count(filename) > 0) {
         auto& seeder_map = group_files[group][filename].seeder_users;
         auto& user_file_map = group_files[group][filename].user_file_map;
 
-        
+        // a seeder without a bitfield has the whole file
+        if (partial_only && group_files[group][filename].seeder_pieces.count(username) == 0) {
+            return false;
+        }
         if (seeder_map.erase(username) > 0) {
             user_file_map.erase(username); // Also remove from user_file_map
+            group_files[group][filename].seeder_pieces.erase(username);
             if(seeder_map.empty()){
                 group_files[group].erase(filename);
             }
@@ -83,3 +88,25 @@ bool FileManager::remove_seeder(const string& username,const string& group,const
     }
     return false;
 }
+
+bool FileManager::update_seeder_pieces(const string& group,const string& filename,const string& username,const Address& addr,const string& file_path,const Bitfield& bits,bool& full_seeder) {
+    lock_guard<mutex> lock(file_mtx);
+    full_seeder = false;
+    if (group_files.count(group) == 0 || group_files[group].count(filename) == 0) {
+        return false;
+    }
+    FileInfo& finfo = group_files[group][filename];
+    size_t pieces = finfo.piece_size == 0 ? 0 : (finfo.size + finfo.piece_size - 1) / finfo.piece_size;
+    if (bits.size() != bitfield_size(pieces)) {
+        return false;
+    }
+    // a seeder without a bitfield already has the whole file
+    if (finfo.seeder_users.count(username) > 0 && finfo.seeder_pieces.count(username) == 0) {
+        full_seeder = true;
+        return true;
+    }
+    finfo.seeder_users[username] = addr;
+    finfo.user_file_map[username] = file_path;
+    finfo.seeder_pieces[username] = bits;
+    return true;
+}